@@ -0,0 +1,283 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <vector>
+
+#include "buffer.h"
+#include "game.h"
+#include "messages.h"
+#include "utils.h"
+
+/*
+ * Micro-benchmarks of the wire codec and of the game simulation, run with
+ * `make bench`. Messages are built from a fixed seed, so that runs compare.
+ */
+
+namespace {
+	const uint64_t BENCH_SEED = 42;
+
+	DataPosition randomPosition(Random & random, uint16_t sizeX, uint16_t sizeY) {
+		return {
+		    {uint16_t(random.next() % sizeX)}, {uint16_t(random.next() % sizeY)}};
+	}
+
+	// An event of the given type, BombExploded destroying `destroyed` of each.
+	DataEvent makeEvent(Random & random, EventEnum type, size_t destroyed) {
+		DataEvent event;
+		event.type = type;
+		event.bombID = {uint32_t(random.next())};
+		event.playerID = {uint8_t(random.next())};
+		event.position = randomPosition(random, UINT16_MAX, UINT16_MAX);
+		if (type == EventEnum::BombExploded) {
+			for (size_t i = 0; i < destroyed; i++) {
+				event.playersDestroyed.list.push_back({uint8_t(i)});
+				event.blocksDestroyed.list.push_back(
+				    randomPosition(random, UINT16_MAX, UINT16_MAX)
+				);
+			}
+		}
+		return event;
+	}
+
+	// A Turn message of `events` events, of all types in turn.
+	DataServerMessage makeTurnMessage(size_t events) {
+		Random random(BENCH_SEED);
+		DataServerMessage message;
+		message.type = ServerMessageEnum::Turn;
+		message.turn = {1};
+		for (size_t i = 0; i < events; i++) {
+			message.events.list.push_back(makeEvent(random, EventEnum(i % 4), 2));
+		}
+		return message;
+	}
+
+	// A Game draw message of a square board, with the given numbers of things.
+	DataDrawMessage
+	makeDrawMessage(uint16_t size, size_t players, size_t blocks, size_t bombs) {
+		Random random(BENCH_SEED);
+		DataDrawMessage message;
+		message.type = DrawMessageEnum::Game;
+		message.serverName = {"bench"};
+		message.sizeX = message.sizeY = {size};
+		message.gameLength = {1000};
+		message.turn = {1};
+		for (size_t i = 0; i < players; i++) {
+			message.players.map[{uint8_t(i)}] = {{"player"}, {"[::1]:10000"}};
+			message.playerPositions.map[{uint8_t(i)}] =
+			    randomPosition(random, size, size);
+			message.scores.map[{uint8_t(i)}] = {uint32_t(i)};
+		}
+		for (size_t i = 0; i < blocks; i++) {
+			message.blocks.set.insert(randomPosition(random, size, size));
+		}
+		for (size_t i = 0; i < bombs; i++) {
+			DataPosition position = randomPosition(random, size, size);
+			message.bombs.list.push_back({position, {uint16_t(i % 8)}});
+			message.explosions.set.insert(position);
+		}
+		return message;
+	}
+
+	// Puts the encoded bytes back into the buffer, to be decoded again.
+	void refill(MemoryBuffer & buffer, const std::vector<char> & bytes) {
+		buffer.clear();
+		memcpy(buffer.prepare(bytes.size()), bytes.data(), bytes.size());
+		buffer.commit(bytes.size());
+	}
+
+	template <typename T> std::vector<char> encode(const T & message) {
+		MemoryBuffer buffer;
+		buffer << message;
+		return {buffer.data(), buffer.data() + buffer.length()};
+	}
+
+	template <typename T>
+	void encodeLoop(benchmark::State & state, const T & message) {
+		MemoryBuffer buffer;
+		for (auto _ : state) {
+			buffer.clear();
+			buffer << message;
+			benchmark::DoNotOptimize(buffer.data());
+		}
+		state.SetBytesProcessed(int64_t(state.iterations() * buffer.length()));
+	}
+
+	template <typename T>
+	void decodeLoop(benchmark::State & state, const T & message) {
+		std::vector<char> bytes = encode(message);
+		MemoryBuffer buffer;
+		T decoded;
+		for (auto _ : state) {
+			refill(buffer, bytes);
+			buffer >> decoded;
+			benchmark::DoNotOptimize(decoded);
+		}
+		state.SetBytesProcessed(int64_t(state.iterations() * bytes.size()));
+	}
+
+	/* Codec */
+
+	void BM_EncodeEvent(benchmark::State & state) {
+		Random random(BENCH_SEED);
+		encodeLoop(state, makeEvent(random, EventEnum(state.range(0)), 4));
+	}
+
+	void BM_DecodeEvent(benchmark::State & state) {
+		Random random(BENCH_SEED);
+		decodeLoop(state, makeEvent(random, EventEnum(state.range(0)), 4));
+	}
+
+	void BM_EncodeTurn(benchmark::State & state) {
+		encodeLoop(state, makeTurnMessage(size_t(state.range(0))));
+	}
+
+	void BM_DecodeTurn(benchmark::State & state) {
+		decodeLoop(state, makeTurnMessage(size_t(state.range(0))));
+	}
+
+	void BM_EncodeDraw(benchmark::State & state) {
+		encodeLoop(
+		    state, makeDrawMessage(
+		               uint16_t(state.range(0)), 16, size_t(state.range(1)), 32
+		           )
+		);
+	}
+
+	void BM_DecodeDraw(benchmark::State & state) {
+		decodeLoop(
+		    state, makeDrawMessage(
+		               uint16_t(state.range(0)), 16, size_t(state.range(1)), 32
+		           )
+		);
+	}
+
+	BENCHMARK(BM_EncodeEvent)->DenseRange(0, 3)->ArgName("type");
+	BENCHMARK(BM_DecodeEvent)->DenseRange(0, 3)->ArgName("type");
+	BENCHMARK(BM_EncodeTurn)
+	    ->RangeMultiplier(8)
+	    ->Range(8, 1 << 15)
+	    ->ArgName("events");
+	BENCHMARK(BM_DecodeTurn)
+	    ->RangeMultiplier(8)
+	    ->Range(8, 1 << 15)
+	    ->ArgName("events");
+	BENCHMARK(BM_EncodeDraw)
+	    ->ArgsProduct({{64, 1024}, {64, 4096, 32768}})
+	    ->ArgNames({"size", "blocks"});
+	BENCHMARK(BM_DecodeDraw)
+	    ->ArgsProduct({{64, 1024}, {64, 4096, 32768}})
+	    ->ArgNames({"size", "blocks"});
+
+	/* Simulation */
+
+	const uint16_t BENCH_EXPLOSION_RADIUS = 4;
+	const uint16_t BENCH_BOMB_TIMER = 5;
+	// Turns after which a game is started anew, before the turn number wraps.
+	const uint16_t BENCH_GAME_LENGTH = 50000;
+	// Inputs are drawn up front, for this many turns, and then repeated.
+	const size_t BENCH_INPUT_TURNS = 256;
+
+	/*
+	 * Plays turns of a game on a square board, an eighth of it blocks at first.
+	 * Each turn, every player places a bomb with the given probability in
+	 * percent, places a block once in a while, and otherwise tries to move.
+	 * Explosions are cast on the given number of threads.
+	 */
+	void BM_GameTurn(benchmark::State & state) {
+		auto size = uint16_t(state.range(0));
+		auto players = size_t(state.range(1));
+		auto bombPercent = uint64_t(state.range(2));
+		auto threads = size_t(state.range(3));
+		auto initialBlocks =
+		    uint16_t(std::min<uint64_t>(UINT16_MAX, uint64_t(size) * size / 8));
+
+		Random random(BENCH_SEED);
+		std::vector<DataClientMessage> inputs(BENCH_INPUT_TURNS * players);
+		for (DataClientMessage & input : inputs) {
+			uint64_t roll = random.next() % 100;
+			if (roll < bombPercent) {
+				input.type = ClientMessageEnum::PlaceBomb;
+			} else if (roll < bombPercent + 2) {
+				input.type = ClientMessageEnum::PlaceBlock;
+			} else {
+				input.type = ClientMessageEnum::Move;
+				input.direction.direction = DirectionEnum(random.next() % 4);
+			}
+		}
+
+		Game game(
+		    size, size, BENCH_EXPLOSION_RADIUS, BENCH_BOMB_TIMER, initialBlocks,
+		    players, BENCH_SEED
+		);
+		WorkerPool workers(threads - 1);
+		game.setWorkers(&workers);
+		DataServerMessage turnMessage;
+		game.start(players, turnMessage);
+		uint16_t turn = 0;
+		size_t events = 0;
+		for (auto _ : state) {
+			if (turn == BENCH_GAME_LENGTH) {
+				state.PauseTiming();
+				game.recycleTurnMessage(turnMessage);
+				game.clear();
+				game.start(players, turnMessage);
+				turn = 0;
+				state.ResumeTiming();
+			}
+			turn++;
+			const DataClientMessage * turnInputs =
+			    &inputs[(turn % BENCH_INPUT_TURNS) * players];
+			for (size_t i = 0; i < players; i++) {
+				game.setInput(uint8_t(i), turnInputs[i]);
+			}
+			game.recycleTurnMessage(turnMessage);
+			game.playTurn(turn, turnMessage);
+			events += turnMessage.events.list.size();
+			benchmark::DoNotOptimize(turnMessage.events.list.data());
+		}
+		state.counters["events"] = benchmark::Counter(
+		    double(events), benchmark::Counter::kAvgIterations
+		);
+		state.counters["blocks"] = double(game.blocks.size());
+	}
+
+	BENCHMARK(BM_GameTurn)
+	    ->ArgsProduct({{16, 256, 4096}, {4, 64, 255}, {0, 5, 25}, {1}})
+	    ->Args({4096, 255, 25, 2})
+	    ->Args({4096, 255, 25, 4})
+	    ->ArgNames({"size", "players", "bombs%", "threads"});
+
+	/*
+	 * Starts a game of 16 players on a square board with the given number of
+	 * initial blocks, and encodes its turn 0, with a block field if allowed.
+	 */
+	void BM_GameStart(benchmark::State & state) {
+		auto size = uint16_t(state.range(0));
+		auto initialBlocks = uint16_t(state.range(1));
+		bool blockField = state.range(2) != 0;
+		const size_t players = 16;
+
+		Game game(
+		    size, size, BENCH_EXPLOSION_RADIUS, BENCH_BOMB_TIMER, initialBlocks,
+		    players, BENCH_SEED
+		);
+		game.setBlockField(blockField);
+		DataServerMessage turn0;
+		turn0.type = ServerMessageEnum::Turn;
+		MemoryBuffer buffer;
+		for (auto _ : state) {
+			game.clear();
+			turn0.events.list.clear();
+			game.start(players, turn0);
+			buffer.clear();
+			buffer << turn0;
+			benchmark::DoNotOptimize(buffer.data());
+		}
+		state.counters["bytes"] = double(buffer.length());
+	}
+
+	BENCHMARK(BM_GameStart)
+	    ->ArgsProduct({{256, 1024, 16384}, {4096, 65535}, {0, 1}})
+	    ->ArgNames({"size", "blocks", "field"});
+} // namespace
+
+BENCHMARK_MAIN();
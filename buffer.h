@@ -117,6 +117,13 @@ public:
 	/* Similar strategy to writeStr. */
 	std::string readStr(const size_t length) {
 		std::string result;
+		readStr(length, result);
+		return result;
+	}
+
+	/* Reads into `result`, reusing its capacity. */
+	void readStr(const size_t length, std::string & result) {
+		result.clear();
 		size_t read = 0;
 		while (read < length) {
 			size_t toRead = std::min(length - read, size);
@@ -125,7 +132,6 @@ public:
 			read += toRead;
 			left += toRead;
 		}
-		return result;
 	}
 
 	Buffer & operator>>([[maybe_unused]] const BufferEncourageReceive & ber) {
@@ -143,6 +149,27 @@ public:
 		return *this;
 	}
 
+	/*
+	 * Makes room for `bytes` bytes at once and returns where to write them, for
+	 * encoders which know the size of what they write up front. At most
+	 * capacity() bytes can be claimed at once.
+	 */
+	char * claim(const size_t bytes) {
+		push(bytes);
+		char * span = buffer + right;
+		right += bytes;
+		return span;
+	}
+
+	[[nodiscard]] size_t capacity() const {
+		return size;
+	}
+
+	/* The number of bytes received ahead, not read yet. */
+	[[nodiscard]] size_t unread() const {
+		return right - left;
+	}
+
 	virtual ~Buffer() {
 		delete[] buffer;
 	}
@@ -152,6 +179,41 @@ public:
 	[[maybe_unused]] static BufferEnsureEnd eEnd;
 };
 
+/*
+ * =============================================================================
+ *                                SpanBuffer
+ * =============================================================================
+ */
+
+/*
+ * Writer into memory claimed from a Buffer, whose size was checked once, up
+ * front. Writes are not virtual and not checked at all.
+ */
+class SpanBuffer {
+private:
+	char * position;
+
+public:
+	explicit SpanBuffer(char * span) : position(span) {
+	}
+
+	void writeU8(const uint8_t src) {
+		*position++ = char(src);
+	}
+
+	void writeU16(const uint16_t src) {
+		uint16_t big = htobe16(src);
+		memcpy(position, &big, sizeof(big));
+		position += sizeof(big);
+	}
+
+	void writeU32(const uint32_t src) {
+		uint32_t big = htobe32(src);
+		memcpy(position, &big, sizeof(big));
+		position += sizeof(big);
+	}
+};
+
 /* Wrapper for a buffer associated with a UDP connection. */
 class UDPBuffer : public Buffer {
 private:
@@ -190,17 +252,26 @@ public:
 		}
 	}
 
+	/* A datagram which does not fit is dropped as a whole. */
 	void push(const size_t bytes) override {
 		if (size - right < bytes) {
+			clear();
 			throw BadWrite();
 		}
 	}
 };
 
-/* Wrapper for a buffer associated with a TCP connection. */
+/*
+ * Wrapper for a buffer associated with a TCP connection.
+ * Receiving reads ahead: it waits for the bytes that are needed, but takes
+ * whatever else has arrived as well, up to the free space in the buffer, so
+ * that most fields are parsed from memory without a system call.
+ */
 class TCPBuffer : public Buffer {
+public:
+	static const size_t TCP_BUFFER_SIZE = 2048;
+
 private:
-	static const int TCP_BUFFER_SIZE = 2048;
 	boost::asio::ip::tcp::socket & socket;
 	boost::system::error_code error;
 
@@ -208,8 +279,9 @@ private:
 		if (bytes == 0) {
 			return;
 		}
-		boost::asio::read(
-		    socket, boost::asio::buffer(buffer + right, bytes), error
+		size_t received = boost::asio::read(
+		    socket, boost::asio::buffer(buffer + right, size - right),
+		    boost::asio::transfer_at_least(bytes), error
 		);
 		if (error == boost::asio::error::eof) {
 			throw BadRead(); // Connection closed cleanly by peer, although
@@ -217,7 +289,7 @@ private:
 		} else if (error) {
 			throw boost::system::system_error(error); // Other error.
 		}
-		right += bytes;
+		right += received;
 	}
 
 	void ensureEnd() override {
@@ -234,24 +306,29 @@ private:
 	}
 
 public:
-	explicit TCPBuffer(boost::asio::ip::tcp::socket & newSocket) :
-	    Buffer(TCP_BUFFER_SIZE), socket(newSocket) {
+	explicit TCPBuffer(
+	    boost::asio::ip::tcp::socket & newSocket, size_t newSize = TCP_BUFFER_SIZE
+	) :
+	    Buffer(newSize),
+	    socket(newSocket) {
 	}
 
 	/*
 	 * Guarantees that there are at least `bytes` bytes to read by
-	 * either receiving enough to fulfill that need or by first copying
-	 * the received-but-not-read bytes to the beginning and then receiving.
+	 * either finding them already received or by first copying
+	 * the received-but-not-read bytes to the beginning and then receiving,
+	 * so that as much as possible can be read ahead.
 	 */
 	void pull(const size_t bytes) override {
-		if (left + bytes > size) {
+		if (right - left >= bytes) {
+			return;
+		}
+		if (left > 0) {
 			memmove(buffer, buffer + left, right - left);
 			right -= left;
 			left = 0;
 		}
-		if (right - left < bytes) {
-			receive(bytes - (right - left));
-		}
+		receive(bytes - (right - left));
 	}
 
 	void push(const size_t bytes) override {
@@ -260,3 +337,90 @@ public:
 		}
 	}
 };
+
+/*
+ * Wrapper for a buffer kept purely in memory, not associated with any socket.
+ * Grows when more space is needed for writing, throws BadRead when reading
+ * past the written bytes. Used to prepare and parse messages for asynchronous
+ * sockets, which cannot be driven by the blocking pull and push.
+ */
+class MemoryBuffer : public Buffer {
+private:
+	void receive([[maybe_unused]] size_t bytes) override {
+	}
+
+	void ensureEnd() override {
+	}
+
+	void send() override {
+	}
+
+	/* Grows the buffer to hold at least `newSize` bytes, keeping its contents. */
+	void grow(const size_t newSize) {
+		size_t grownSize = std::max(newSize, 2 * size);
+		char * grownBuffer = new char[grownSize];
+		memcpy(grownBuffer, buffer, right);
+		delete[] buffer;
+		buffer = grownBuffer;
+		size = grownSize;
+	}
+
+public:
+	explicit MemoryBuffer(size_t initialSize = 64) : Buffer(initialSize) {
+	}
+
+	MemoryBuffer(const MemoryBuffer &) = delete;
+	MemoryBuffer & operator=(const MemoryBuffer &) = delete;
+
+	void pull(const size_t bytes) override {
+		if (right - left < bytes) {
+			throw BadRead();
+		}
+	}
+
+	void push(const size_t bytes) override {
+		if (size - right < bytes) {
+			grow(right + bytes);
+		}
+	}
+
+	using Buffer::clear;
+
+	/*
+	 * Returns a pointer to at least `bytes` bytes of free space after the
+	 * written bytes, for receiving into. Read bytes are discarded to make space.
+	 */
+	char * prepare(const size_t bytes) {
+		if (left == right) {
+			clear();
+		} else if (size - right < bytes && left > 0) {
+			memmove(buffer, buffer + left, right - left);
+			right -= left;
+			left = 0;
+		}
+		push(bytes);
+		return buffer + right;
+	}
+
+	/* Marks `bytes` bytes after the written ones as written. */
+	void commit(const size_t bytes) {
+		right += bytes;
+	}
+
+	[[nodiscard]] const char * data() const {
+		return buffer + left;
+	}
+
+	[[nodiscard]] size_t length() const {
+		return right - left;
+	}
+
+	/* Reading position, which can later be returned to with rewind(). */
+	[[nodiscard]] size_t position() const {
+		return left;
+	}
+
+	void rewind(const size_t newPosition) {
+		left = newPosition;
+	}
+};
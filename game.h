@@ -0,0 +1,440 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <utility>
+#include <vector>
+
+#include "grid.h"
+#include "messages.h"
+#include "trace.h"
+#include "utils.h"
+#include "workers.h"
+
+/*
+ * =============================================================================
+ *                                 Game
+ * =============================================================================
+ */
+
+/* What a player asked to do this turn, moves in the order of DirectionEnum. */
+enum class PlayerAction : uint8_t {
+	None,
+	PlaceBomb,
+	PlaceBlock,
+	MoveUp,
+	MoveRight,
+	MoveDown,
+	MoveLeft
+};
+
+/*
+ * The rules of one game, without any of the networking around it: the board,
+ * the players' positions and scores and the active bombs. Each turn is written
+ * as events into the given turn message, in the order clients expect them.
+ * The lists inside BombExploded events are put aside when a turn message is
+ * recycled, for the following turns, so that turns do not allocate once the
+ * game warms up.
+ * Players are kept as parallel arrays indexed by player ID, so that a turn
+ * walks each of them once. Every bomb explodes bombTimer turns after it was
+ * placed, so bombs wait in a wheel of bombTimer + 1 slots, one per turn. Each
+ * slot is kept sorted like the bombs of one turn were in a priority queue,
+ * by position and ID, which is the order of their explosions.
+ * Explosions of one turn all see the board as it was before the turn, so with
+ * workers they are cast in parallel, each into its own event, and only then
+ * applied to the board, in bomb order.
+ */
+class Game {
+public:
+	uint16_t sizeX, sizeY;
+	uint16_t explosionRadius;
+	uint16_t bombTimer;
+	uint16_t initialBlocks;
+
+	using Bomb = std::pair<DataBomb, DataU32>;
+
+	// Fewer explosions in a turn are not worth waking the workers up for.
+	static const size_t PARALLEL_EXPLOSIONS_MIN = 32;
+	// Encoded sizes of a BlockPlaced event and of a BlockField one, but its bits.
+	static const size_t BLOCK_PLACED_SIZE = 1 + FIXED_SIZE<DataPosition>;
+	static const size_t BLOCK_FIELD_HEADER_SIZE = 1 + sizeof(uint32_t);
+
+	Random random;
+	PositionGrid blocks;
+	// Slot `timer % bombWheel.size()` holds the bombs exploding in turn `timer`.
+	std::vector<std::vector<Bomb>> bombWheel;
+	uint32_t nextBombID = 0;
+	std::vector<DataPosition> positions;
+	std::vector<PlayerAction> actions;
+	DataMap<DataU8, DataU32> playerScores;
+	PlayerOccupancy playersByPosition;
+	std::bitset<PlayerOccupancy::PLAYERS_MAX> playersDestroyed;
+	// Positions of this turn's exploding bombs, in the order of their events.
+	std::vector<DataPosition> explodingBombs;
+	WorkerPool * workers = nullptr;
+	bool blockField = false;
+
+	std::vector<std::vector<DataU8>> sparePlayerLists;
+	std::vector<std::vector<DataPosition>> spareBlockLists;
+
+	Game(
+	    uint16_t newSizeX, uint16_t newSizeY, uint16_t newExplosionRadius,
+	    uint16_t newBombTimer, uint16_t newInitialBlocks, size_t playerCount,
+	    uint64_t seed
+	) :
+	    sizeX(newSizeX), sizeY(newSizeY), explosionRadius(newExplosionRadius),
+	    bombTimer(newBombTimer), initialBlocks(newInitialBlocks), random(seed),
+	    blocks(sizeX, sizeY), bombWheel(size_t(bombTimer) + 1) {
+		playersByPosition.reset(playerCount, sizeX, sizeY);
+	}
+
+	[[nodiscard]] DataPosition randomPosition() {
+		return {
+		    {uint16_t(random.next() % sizeX)}, {uint16_t(random.next() % sizeY)}};
+	}
+
+	[[nodiscard]] size_t playerCount() const {
+		return positions.size();
+	}
+
+	/*
+	 * Places `count` players and the initial blocks, as events of turn 0. The
+	 * blocks are listed in the order they were drawn in, unless they may be
+	 * sent as a block field. They are then drawn into the grid at once, and
+	 * listed as by listBlocks(). Either way, the same blocks are drawn.
+	 */
+	void start(size_t count, DataServerMessage & turn0) {
+		positions.assign(count, {});
+		actions.assign(count, PlayerAction::None);
+		for (size_t i = 0; i < count; i++) {
+			positions[i] = randomPosition();
+			DataEvent event;
+			event.type = EventEnum::PlayerMoved;
+			event.playerID = {uint8_t(i)};
+			event.position = positions[i];
+			turn0.events.list.push_back(event);
+		}
+		blocks.reserve(initialBlocks);
+		if (blockField) {
+			for (uint16_t i = 0; i < initialBlocks; i++) {
+				blocks.insert(randomPosition());
+			}
+			listBlocks(turn0.events);
+			return;
+		}
+		turn0.events.list.reserve(turn0.events.list.size() + initialBlocks);
+		for (uint16_t i = 0; i < initialBlocks; i++) {
+			DataPosition position = randomPosition();
+			if (blocks.insert(position)) {
+				DataEvent & event = turn0.events.list.emplace_back();
+				event.type = EventEnum::BlockPlaced;
+				event.position = position;
+			}
+		}
+	}
+
+	/*
+	 * Adds events placing all blocks: one BlockField event, if allowed and
+	 * shorter, or else a BlockPlaced event for each block, in the grid's order.
+	 */
+	void listBlocks(DataList<DataEvent> & events) const {
+		if (blockField && blocks.isDense() &&
+		    BLOCK_FIELD_HEADER_SIZE + blocks.fieldSize() <
+		        BLOCK_PLACED_SIZE * blocks.size()) {
+			DataEvent & event = events.list.emplace_back();
+			event.type = EventEnum::BlockField;
+			blocks.writeField(event.blockField.list);
+			return;
+		}
+		events.list.reserve(events.list.size() + blocks.size());
+		blocks.forEach([&](const DataPosition & block) {
+			DataEvent & event = events.list.emplace_back();
+			event.type = EventEnum::BlockPlaced;
+			event.position = block;
+		});
+	}
+
+	/* Keeps the message as the player's move for this turn, if in the game. */
+	void setInput(uint8_t playerID, const DataClientMessage & message) {
+		if (playerID >= actions.size()) {
+			return;
+		}
+		switch (message.type) {
+		case ClientMessageEnum::PlaceBomb:
+			actions[playerID] = PlayerAction::PlaceBomb;
+			break;
+		case ClientMessageEnum::PlaceBlock:
+			actions[playerID] = PlayerAction::PlaceBlock;
+			break;
+		case ClientMessageEnum::Move:
+			actions[playerID] = PlayerAction(
+			    uint8_t(PlayerAction::MoveUp) +
+			    uint8_t(message.direction.direction)
+			);
+			break;
+		default:
+			actions[playerID] = PlayerAction::None;
+			break;
+		}
+	}
+
+	/* Calls `f` with every active bomb, in the order they will explode in. */
+	template <typename F> void forEachBomb(uint16_t turn, const F & f) const {
+		for (size_t i = 1; i <= bombWheel.size(); i++) {
+			for (const Bomb & bomb : bombWheel[(turn + i) % bombWheel.size()]) {
+				f(bomb);
+			}
+		}
+	}
+
+	// Prepares a BombExploded event, reusing lists put aside in earlier turns.
+	DataEvent makeExplosionEvent() {
+		DataEvent event;
+		event.type = EventEnum::BombExploded;
+		if (!sparePlayerLists.empty()) {
+			event.playersDestroyed.list.swap(sparePlayerLists.back());
+			sparePlayerLists.pop_back();
+		}
+		if (!spareBlockLists.empty()) {
+			event.blocksDestroyed.list.swap(spareBlockLists.back());
+			spareBlockLists.pop_back();
+		}
+		return event;
+	}
+
+	// Empties the turn message, putting aside the lists of its events.
+	void recycleTurnMessage(DataServerMessage & turnMessage) {
+		for (DataEvent & event : turnMessage.events.list) {
+			if (event.type == EventEnum::BombExploded) {
+				event.playersDestroyed.list.clear();
+				sparePlayerLists.push_back(std::move(event.playersDestroyed.list));
+				event.blocksDestroyed.list.clear();
+				spareBlockLists.push_back(std::move(event.blocksDestroyed.list));
+			}
+		}
+		turnMessage.events.list.clear();
+	}
+
+	/* Plays the turn: explosions first, then the moves of all players. */
+	void playTurn(uint16_t turn, DataServerMessage & turnMessage) {
+		turnMessage.type = ServerMessageEnum::Turn;
+		turnMessage.turn = {turn};
+
+		playersDestroyed.reset();
+
+		{
+			TraceScope scope("explosions", turn);
+			processExplosions(turn, turnMessage);
+		}
+		TraceScope scope("moves", turn);
+		for (size_t i = 0; i < positions.size(); i++) {
+			processPlayerMove(uint8_t(i), turnMessage);
+		}
+	}
+
+	// Processes explosion at the bomb, returns whether it reaches further.
+	bool
+	processExplosion(const DataPosition & position, DataEvent & event) const {
+		playersByPosition.forEach(position, [&](uint8_t playerID) {
+			event.playersDestroyed.list.push_back({playerID});
+		});
+		if (blocks.contains(position)) {
+			event.blocksDestroyed.list.push_back(position);
+			return false;
+		}
+		return true;
+	}
+
+	/*
+	 * Adds what the explosion hits beyond the bomb towards `direction`, as the
+	 * cell by cell walk of processExplosion() would: the players on each cell,
+	 * nearest first, up to and including the first block. Both are found by
+	 * scanning the bitmaps of blocks and of occupied cells along the ray.
+	 */
+	void castRay(
+	    const DataPosition & bombPosition, DirectionEnum direction,
+	    DataEvent & event
+	) const {
+		uint32_t length =
+		    blocks.cellsAlong(bombPosition, direction, explosionRadius + 1U) - 1;
+		if (length == 0) {
+			return;
+		}
+		DataPosition start = PositionGrid::along(bombPosition, direction, 1);
+		uint32_t blockStep = blocks.firstAlong(start, direction, length);
+		uint32_t reach = std::min(blockStep + 1, length);
+		playersByPosition.positions().forEachAlong(
+		    start, direction, reach,
+		    [&](uint32_t step) {
+			    DataPosition position = PositionGrid::along(start, direction, step);
+			    playersByPosition.forEach(position, [&](uint8_t playerID) {
+				    event.playersDestroyed.list.push_back({playerID});
+			    });
+			    return true;
+		    }
+		);
+		if (blockStep < length) {
+			event.blocksDestroyed.list.push_back(
+			    PositionGrid::along(start, direction, blockStep)
+			);
+		}
+	}
+
+	/* Fills the event with everything the bomb's explosion hits. */
+	void
+	castExplosion(const DataPosition & bombPosition, DataEvent & event) const {
+		if (processExplosion(bombPosition, event)) {
+			castRay(bombPosition, DirectionEnum::Left, event);
+			castRay(bombPosition, DirectionEnum::Right, event);
+			castRay(bombPosition, DirectionEnum::Down, event);
+			castRay(bombPosition, DirectionEnum::Up, event);
+		}
+	}
+
+	void processExplosions(uint16_t turn, DataServerMessage & turnMessage) {
+		std::vector<Bomb> & slot = bombWheel[turn % bombWheel.size()];
+		std::vector<DataEvent> & events = turnMessage.events.list;
+		size_t firstEvent = events.size();
+		explodingBombs.clear();
+		// Only a bomb timer of 0 leaves bombs which are not due in the slot.
+		size_t kept = 0;
+		for (const Bomb & entry : slot) {
+			if (entry.first.timer.value != turn) {
+				slot[kept++] = entry;
+				continue;
+			}
+			DataEvent & event = events.emplace_back(makeExplosionEvent());
+			event.bombID = entry.second;
+			explodingBombs.push_back(entry.first.position);
+		}
+		slot.resize(kept);
+
+		auto explode = [&](size_t bomb) {
+			castExplosion(explodingBombs[bomb], events[firstEvent + bomb]);
+		};
+		if (workers && explodingBombs.size() >= PARALLEL_EXPLOSIONS_MIN) {
+			workers->run(explodingBombs.size(), explode);
+		} else {
+			for (size_t bomb = 0; bomb < explodingBombs.size(); bomb++) {
+				explode(bomb);
+			}
+		}
+
+		for (size_t i = firstEvent; i < events.size(); i++) {
+			for (const DataU8 & playerID : events[i].playersDestroyed.list) {
+				playersDestroyed.set(playerID.value);
+			}
+			for (const DataPosition & block : events[i].blocksDestroyed.list) {
+				blocks.erase(block);
+			}
+		}
+	}
+
+	void processPlayerMove(uint8_t playerID, DataServerMessage & turnMessage) {
+		DataPosition position = positions[playerID];
+		PlayerAction action = actions[playerID];
+		// Mark the action as done.
+		actions[playerID] = PlayerAction::None;
+
+		DataEvent event;
+		DataPosition newPosition;
+		int newX = position.x.value, newY = position.y.value;
+		if (playersDestroyed.test(playerID)) {
+			newPosition = randomPosition();
+			playersByPosition.erase(position, playerID);
+			playersByPosition.insert(newPosition, playerID);
+			positions[playerID] = newPosition;
+			playerScores.map[{playerID}].value++;
+
+			event.type = EventEnum::PlayerMoved;
+			event.playerID = {playerID};
+			event.position = newPosition;
+			turnMessage.events.list.push_back(event);
+			return;
+		}
+
+		switch (action) {
+		case PlayerAction::PlaceBomb: {
+			event.type = EventEnum::BombPlaced;
+			event.bombID = {nextBombID++};
+			event.position = position;
+			turnMessage.events.list.push_back(event);
+
+			Bomb bomb = {
+			    {position, {uint16_t(turnMessage.turn.value + bombTimer)}},
+			    event.bombID};
+			std::vector<Bomb> & slot =
+			    bombWheel[bomb.first.timer.value % bombWheel.size()];
+			slot.insert(std::upper_bound(slot.begin(), slot.end(), bomb), bomb);
+			break;
+		}
+		case PlayerAction::PlaceBlock:
+			if (!blocks.insert(position)) {
+				break;
+			}
+			event.type = EventEnum::BlockPlaced;
+			event.position = position;
+			turnMessage.events.list.push_back(event);
+			break;
+		case PlayerAction::MoveUp:
+		case PlayerAction::MoveRight:
+		case PlayerAction::MoveDown:
+		case PlayerAction::MoveLeft:
+			switch (action) {
+			case PlayerAction::MoveLeft:
+				newX = position.x.value - 1;
+				break;
+			case PlayerAction::MoveRight:
+				newX = position.x.value + 1;
+				break;
+			case PlayerAction::MoveDown:
+				newY = position.y.value - 1;
+				break;
+			default:
+				newY = position.y.value + 1;
+				break;
+			}
+
+			if (newX < 0 || newY < 0 || newX >= sizeX || newY >= sizeY ||
+			    blocks.contains(
+			        newPosition = {{uint16_t(newX)}, {uint16_t(newY)}}
+			    )) {
+				break;
+			}
+			positions[playerID] = newPosition;
+			playersByPosition.erase(position, playerID);
+			playersByPosition.insert(newPosition, playerID);
+			event.type = EventEnum::PlayerMoved;
+			event.playerID = {playerID};
+			event.position = newPosition;
+			turnMessage.events.list.push_back(event);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Lets the explosions of large turns be cast on the given workers. */
+	void setWorkers(WorkerPool * newWorkers) {
+		workers = newWorkers;
+	}
+
+	/* Lets all blocks be sent as one BlockField event, where that is shorter. */
+	void setBlockField(bool newBlockField) {
+		blockField = newBlockField;
+	}
+
+	/* Clears the board for the next game, the random sequence goes on. */
+	void clear() {
+		positions.clear();
+		actions.clear();
+		blocks.clear();
+		playerScores.map.clear();
+		playersByPosition.clear();
+		for (std::vector<Bomb> & slot : bombWheel) {
+			slot.clear();
+		}
+		sparePlayerLists.clear();
+		spareBlockLists.clear();
+	}
+};
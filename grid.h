@@ -0,0 +1,478 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <unordered_set>
+#include <vector>
+
+#include "messages.h"
+
+/*
+ * =============================================================================
+ *                              PositionGrid
+ * =============================================================================
+ */
+
+/*
+ * A set of positions on a board of known size, with constant time lookups.
+ * Boards with at most DENSE_CELLS_MAX cells are stored as a dense bitmap,
+ * indexed column by column, so that walking the bitmap visits positions in the
+ * order defined by DataPosition::operator<. The same bitmap is also kept row by
+ * row, so that a ray along either axis covers consecutive bits and is scanned
+ * a word at a time. Larger boards fall back to a hash set, since their bitmaps
+ * could take up to a gigabyte.
+ */
+class PositionGrid {
+public:
+	static const uint64_t DENSE_CELLS_MAX = 1ULL << 26; // 2 bitmaps of 8 MiB
+
+private:
+	static const uint64_t WORD_BITS = 64;
+
+	uint16_t sizeX = 0, sizeY = 0;
+	bool dense = true;
+	std::vector<uint64_t> bits;
+	// The bitmap transposed, indexed row by row.
+	std::vector<uint64_t> rowBits;
+	std::unordered_set<uint32_t> sparse;
+	size_t count = 0;
+
+	[[nodiscard]] uint64_t index(const DataPosition & position) const {
+		return uint64_t(position.x.value) * sizeY + position.y.value;
+	}
+
+	[[nodiscard]] uint64_t rowIndex(const DataPosition & position) const {
+		return uint64_t(position.y.value) * sizeX + position.x.value;
+	}
+
+	/*
+	 * Calls `f` with the index of every set bit among the `length` bits from
+	 * `first` up, lowest first, for as long as `f` returns true.
+	 */
+	template <typename F>
+	static void scanUp(
+	    const std::vector<uint64_t> & words, uint64_t first, uint64_t length,
+	    const F & f
+	) {
+		uint64_t end = first + length;
+		for (uint64_t i = first; i < end;) {
+			uint64_t span = std::min(WORD_BITS - i % WORD_BITS, end - i);
+			uint64_t word = words[i / WORD_BITS] >> (i % WORD_BITS);
+			if (span < WORD_BITS) {
+				word &= (1ULL << span) - 1;
+			}
+			for (; word; word &= word - 1) {
+				if (!f(i + uint64_t(std::countr_zero(word)))) {
+					return;
+				}
+			}
+			i += span;
+		}
+	}
+
+	/*
+	 * Calls `f` with the index of every set bit among the `length` bits from
+	 * `last` down, highest first, for as long as `f` returns true.
+	 */
+	template <typename F>
+	static void scanDown(
+	    const std::vector<uint64_t> & words, uint64_t last, uint64_t length,
+	    const F & f
+	) {
+		uint64_t stop = last + 1 - length;
+		for (uint64_t end = last + 1; end > stop;) {
+			uint64_t low = std::max(stop, (end - 1) / WORD_BITS * WORD_BITS);
+			uint64_t span = end - low;
+			uint64_t word = words[low / WORD_BITS] >> (low % WORD_BITS);
+			if (span < WORD_BITS) {
+				word &= (1ULL << span) - 1;
+			}
+			while (word) {
+				int top = int(WORD_BITS) - 1 - std::countl_zero(word);
+				if (!f(low + uint64_t(top))) {
+					return;
+				}
+				word &= ~(1ULL << top);
+			}
+			end = low;
+		}
+	}
+
+	static uint32_t key(const DataPosition & position) {
+		return uint32_t(position.x.value) << 16 | position.y.value;
+	}
+
+public:
+	PositionGrid() = default;
+
+	PositionGrid(uint16_t newSizeX, uint16_t newSizeY) {
+		reset(newSizeX, newSizeY);
+	}
+
+	/* Empties the grid and prepares it for a board of the given size. */
+	void reset(uint16_t newSizeX, uint16_t newSizeY) {
+		sizeX = newSizeX, sizeY = newSizeY;
+		uint64_t cells = uint64_t(sizeX) * sizeY;
+		dense = cells <= DENSE_CELLS_MAX;
+		bits.assign(dense ? (cells + WORD_BITS - 1) / WORD_BITS : 0, 0);
+		rowBits.assign(bits.size(), 0);
+		sparse.clear();
+		count = 0;
+	}
+
+	void clear() {
+		std::fill(bits.begin(), bits.end(), 0);
+		std::fill(rowBits.begin(), rowBits.end(), 0);
+		sparse.clear();
+		count = 0;
+	}
+
+	[[nodiscard]] bool contains(const DataPosition & position) const {
+		if (!dense) {
+			return sparse.contains(key(position));
+		}
+		uint64_t i = index(position);
+		return (bits[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+	}
+
+	/* Returns whether the position was not in the grid before. */
+	bool insert(const DataPosition & position) {
+		bool inserted;
+		if (!dense) {
+			inserted = sparse.insert(key(position)).second;
+		} else {
+			uint64_t i = index(position);
+			uint64_t mask = 1ULL << (i % WORD_BITS);
+			inserted = !(bits[i / WORD_BITS] & mask);
+			bits[i / WORD_BITS] |= mask;
+			uint64_t row = rowIndex(position);
+			rowBits[row / WORD_BITS] |= 1ULL << (row % WORD_BITS);
+		}
+		count += inserted;
+		return inserted;
+	}
+
+	/* Returns whether the position was in the grid before. */
+	bool erase(const DataPosition & position) {
+		bool erased;
+		if (!dense) {
+			erased = sparse.erase(key(position)) > 0;
+		} else {
+			uint64_t i = index(position);
+			uint64_t mask = 1ULL << (i % WORD_BITS);
+			erased = bits[i / WORD_BITS] & mask;
+			bits[i / WORD_BITS] &= ~mask;
+			uint64_t row = rowIndex(position);
+			rowBits[row / WORD_BITS] &= ~(1ULL << (row % WORD_BITS));
+		}
+		count -= erased;
+		return erased;
+	}
+
+	[[nodiscard]] size_t size() const {
+		return count;
+	}
+
+	/* Makes room for `positions` positions, before inserting many of them. */
+	void reserve(size_t positions) {
+		if (!dense) {
+			sparse.reserve(positions);
+		}
+	}
+
+	/* The number of bytes of a block field of the board. */
+	[[nodiscard]] uint64_t fieldSize() const {
+		return (uint64_t(sizeX) * sizeY + 7) / 8;
+	}
+
+	/* Writes the grid as a block field, see DataEvent. Only when dense. */
+	void writeField(std::vector<DataU8> & field) const {
+		field.resize(fieldSize());
+		for (size_t i = 0; i < field.size(); i++) {
+			field[i] = {uint8_t(bits[i / 8] >> (i % 8 * 8))};
+		}
+	}
+
+	/* Inserts every position of a block field, calls `f` with the new ones. */
+	template <typename F>
+	void insertField(const std::vector<DataU8> & field, const F & f) {
+		uint64_t cells = uint64_t(sizeX) * sizeY;
+		for (size_t byte = 0; byte < field.size(); byte++) {
+			uint8_t byteBits = field[byte].value;
+			for (; byteBits; byteBits = uint8_t(byteBits & (byteBits - 1))) {
+				uint64_t i = byte * 8 + uint64_t(std::countr_zero(byteBits));
+				if (i >= cells) {
+					return;
+				}
+				DataPosition position{{uint16_t(i / sizeY)}, {uint16_t(i % sizeY)}};
+				if (insert(position)) {
+					f(position);
+				}
+			}
+		}
+	}
+
+	/* Calls `f` with every position in the grid, in increasing order if dense. */
+	template <typename F> void forEach(const F & f) const {
+		if (!dense) {
+			for (uint32_t cellKey : sparse) {
+				f(DataPosition{{uint16_t(cellKey >> 16)}, {uint16_t(cellKey)}});
+			}
+			return;
+		}
+		for (size_t word = 0; word < bits.size(); word++) {
+			uint64_t wordBits = bits[word];
+			while (wordBits) {
+				uint64_t i = word * WORD_BITS + uint64_t(std::countr_zero(wordBits));
+				f(DataPosition{{uint16_t(i / sizeY)}, {uint16_t(i % sizeY)}});
+				wordBits &= wordBits - 1;
+			}
+		}
+	}
+
+	[[nodiscard]] bool isDense() const {
+		return dense;
+	}
+
+	/* Returns the position `steps` cells away from `from` towards `direction`. */
+	static DataPosition
+	along(const DataPosition & from, DirectionEnum direction, uint32_t steps) {
+		DataPosition position = from;
+		switch (direction) {
+		case DirectionEnum::Up:
+			position.y.value = uint16_t(position.y.value + steps);
+			break;
+		case DirectionEnum::Right:
+			position.x.value = uint16_t(position.x.value + steps);
+			break;
+		case DirectionEnum::Down:
+			position.y.value = uint16_t(position.y.value - steps);
+			break;
+		case DirectionEnum::Left:
+			position.x.value = uint16_t(position.x.value - steps);
+			break;
+		}
+		return position;
+	}
+
+	/*
+	 * Returns how many cells lie from `from`, included, towards `direction`
+	 * until the edge of the board, at most `limit`.
+	 */
+	[[nodiscard]] uint32_t cellsAlong(
+	    const DataPosition & from, DirectionEnum direction, uint32_t limit
+	) const {
+		uint32_t cells = 0;
+		switch (direction) {
+		case DirectionEnum::Up:
+			cells = uint32_t(sizeY - from.y.value);
+			break;
+		case DirectionEnum::Right:
+			cells = uint32_t(sizeX - from.x.value);
+			break;
+		case DirectionEnum::Down:
+			cells = uint32_t(from.y.value) + 1;
+			break;
+		case DirectionEnum::Left:
+			cells = uint32_t(from.x.value) + 1;
+			break;
+		}
+		return std::min(cells, limit);
+	}
+
+	/*
+	 * Calls `f` with the distance from `from` of every position in the grid
+	 * among the `length` cells from `from` towards `direction`, nearest first,
+	 * for as long as `f` returns true. The cells must be on the board.
+	 */
+	template <typename F>
+	void forEachAlong(
+	    const DataPosition & from, DirectionEnum direction, uint32_t length,
+	    const F & f
+	) const {
+		if (length == 0) {
+			return;
+		}
+		if (!dense) {
+			for (uint32_t step = 0; step < length; step++) {
+				if (contains(along(from, direction, step)) && !f(step)) {
+					return;
+				}
+			}
+			return;
+		}
+		uint64_t column = index(from), row = rowIndex(from);
+		switch (direction) {
+		case DirectionEnum::Up:
+			scanUp(bits, column, length, [&](uint64_t i) {
+				return f(uint32_t(i - column));
+			});
+			break;
+		case DirectionEnum::Right:
+			scanUp(rowBits, row, length, [&](uint64_t i) {
+				return f(uint32_t(i - row));
+			});
+			break;
+		case DirectionEnum::Down:
+			scanDown(bits, column, length, [&](uint64_t i) {
+				return f(uint32_t(column - i));
+			});
+			break;
+		case DirectionEnum::Left:
+			scanDown(rowBits, row, length, [&](uint64_t i) {
+				return f(uint32_t(row - i));
+			});
+			break;
+		}
+	}
+
+	/*
+	 * Returns the distance to the nearest position in the grid among the
+	 * `length` cells from `from` towards `direction`, or `length` if none is.
+	 */
+	[[nodiscard]] uint32_t firstAlong(
+	    const DataPosition & from, DirectionEnum direction, uint32_t length
+	) const {
+		uint32_t first = length;
+		forEachAlong(from, direction, length, [&](uint32_t step) {
+			first = step;
+			return false;
+		});
+		return first;
+	}
+};
+
+/*
+ * =============================================================================
+ *                             PlayerOccupancy
+ * =============================================================================
+ */
+
+/*
+ * Index of the players standing on each occupied position. With at most
+ * PLAYERS_MAX players, each occupied cell keeps a 256-bit mask of player IDs.
+ * Cells live in an open addressing hash table of fixed capacity, chosen on
+ * reset(), so that moving players around never allocates memory. The occupied
+ * cells are also kept in a grid of the board, for finding them along a ray.
+ */
+class PlayerOccupancy {
+public:
+	static const size_t PLAYERS_MAX = 256;
+
+	using PlayerMask = std::array<uint64_t, PLAYERS_MAX / 64>;
+
+private:
+	class Cell {
+	public:
+		uint32_t key = 0;
+		PlayerMask players{};
+
+		[[nodiscard]] bool empty() const {
+			for (uint64_t word : players) {
+				if (word) {
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	std::vector<Cell> cells;
+	size_t capacityMask = 0;
+	// The bits of a key's hash left out of its home slot.
+	int homeShift = 31;
+	PositionGrid occupied;
+
+	static uint32_t key(const DataPosition & position) {
+		return uint32_t(position.x.value) << 16 | position.y.value;
+	}
+
+	// Fibonacci hashing: the top bits of the product depend on all of the key,
+	// while the low ones only depend on y.
+	[[nodiscard]] size_t home(uint32_t cellKey) const {
+		return size_t(uint32_t(cellKey * 0x9E3779B1U) >> homeShift);
+	}
+
+	/* Returns the slot holding `cellKey`, or the empty slot it would go to. */
+	[[nodiscard]] size_t find(uint32_t cellKey) const {
+		size_t slot = home(cellKey);
+		while (!cells[slot].empty() && cells[slot].key != cellKey) {
+			slot = (slot + 1) & capacityMask;
+		}
+		return slot;
+	}
+
+	/* Empties a slot, moving back the cells that probed past it. */
+	void vacate(size_t slot) {
+		size_t next = (slot + 1) & capacityMask;
+		while (!cells[next].empty()) {
+			size_t nextHome = home(cells[next].key);
+			// Move the cell back if its home is not in (slot, next].
+			if (((next - nextHome) & capacityMask) >=
+			    ((next - slot) & capacityMask)) {
+				cells[slot] = cells[next];
+				slot = next;
+			}
+			next = (next + 1) & capacityMask;
+		}
+		cells[slot] = Cell();
+	}
+
+public:
+	/* Empties the index and prepares it for up to `players` players. */
+	void reset(size_t players, uint16_t sizeX, uint16_t sizeY) {
+		size_t capacity = std::bit_ceil(std::max<size_t>(2 * players, 2));
+		cells.assign(capacity, Cell());
+		capacityMask = capacity - 1;
+		homeShift = 32 - std::countr_zero(capacity);
+		occupied.reset(sizeX, sizeY);
+	}
+
+	void clear() {
+		std::fill(cells.begin(), cells.end(), Cell());
+		occupied.clear();
+	}
+
+	void insert(const DataPosition & position, uint8_t playerID) {
+		Cell & cell = cells[find(key(position))];
+		cell.key = key(position);
+		cell.players[playerID / 64] |= 1ULL << (playerID % 64);
+		occupied.insert(position);
+	}
+
+	void erase(const DataPosition & position, uint8_t playerID) {
+		size_t slot = find(key(position));
+		if (cells[slot].empty()) {
+			return;
+		}
+		cells[slot].players[playerID / 64] &= ~(1ULL << (playerID % 64));
+		if (cells[slot].empty()) {
+			vacate(slot);
+			occupied.erase(position);
+		}
+	}
+
+	/* The number of slots looked at to find `position`, at least 1. */
+	[[nodiscard]] size_t probes(const DataPosition & position) const {
+		return ((find(key(position)) - home(key(position))) & capacityMask) + 1;
+	}
+
+	/* The positions with at least one player on them. */
+	[[nodiscard]] const PositionGrid & positions() const {
+		return occupied;
+	}
+
+	/* Calls `f` with the ID of every player at `position`, in increasing order. */
+	template <typename F>
+	void forEach(const DataPosition & position, const F & f) const {
+		const Cell & cell = cells[find(key(position))];
+		for (size_t word = 0; word < cell.players.size(); word++) {
+			uint64_t bits = cell.players[word];
+			while (bits) {
+				f(uint8_t(word * 64 + size_t(std::countr_zero(bits))));
+				bits &= bits - 1;
+			}
+		}
+	}
+};
\ No newline at end of file
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
 #include <map>
 #include <set>
+#include <span>
+#include <tuple>
 #include <vector>
 
 #include "buffer.h"
@@ -29,6 +34,99 @@ concept ComparableData = Data<T> && requires(T & a, T & b) {
 	{ a < b } -> std::same_as<bool>;
 };
 
+/*
+ * Compile-time description of data.
+ * FIXED_SIZE<T> is the number of bytes T is always encoded in, or 0 if that
+ * varies. Types of fixed size are encoded through a SpanBuffer: space for them,
+ * or for a whole run of them in a list, is claimed from the Buffer once, and
+ * the fields are then written in a straight line.
+ * Structures list their fields once, in order, in DataFields<T>::fields. Their
+ * encoders, decoders and fixed size are then generated from that list.
+ */
+template <typename T> constexpr size_t FIXED_SIZE = 0;
+
+template <typename T> class DataFields {};
+
+template <typename T> concept Described = requires {
+	DataFields<T>::fields;
+};
+
+template <Described T> constexpr size_t describedSize() {
+	return std::apply(
+	    [](auto... fields) {
+		    size_t sizes[] = {
+		        FIXED_SIZE<std::remove_cvref_t<decltype(std::declval<T>().*fields)>>...};
+		    size_t total = 0;
+		    for (size_t fieldSize : sizes) {
+			    if (fieldSize == 0) {
+				    return size_t(0);
+			    }
+			    total += fieldSize;
+		    }
+		    return total;
+	    },
+	    DataFields<T>::fields
+	);
+}
+
+template <Described T> constexpr size_t FIXED_SIZE<T> = describedSize<T>();
+
+template <Described T>
+SpanBuffer & operator<<(SpanBuffer & span, const T & data) {
+	std::apply(
+	    [&](auto... fields) {
+		    ((span << data.*fields), ...);
+	    },
+	    DataFields<T>::fields
+	);
+	return span;
+}
+
+template <Described T> Buffer & operator<<(Buffer & buffer, const T & data) {
+	if constexpr (FIXED_SIZE<T> > 0) {
+		SpanBuffer span(buffer.claim(FIXED_SIZE<T>));
+		span << data;
+	} else {
+		std::apply(
+		    [&](auto... fields) {
+			    ((buffer << data.*fields), ...);
+		    },
+		    DataFields<T>::fields
+		);
+	}
+	return buffer;
+}
+
+template <Described T> Buffer & operator>>(Buffer & buffer, T & data) {
+	std::apply(
+	    [&](auto... fields) {
+		    ((buffer >> data.*fields), ...);
+	    },
+	    DataFields<T>::fields
+	);
+	return buffer;
+}
+
+/*
+ * Encodes `count` elements of `elementSize` bytes each, starting at `element`,
+ * claiming space for as many of them at once as the buffer can hold.
+ */
+template <typename I, typename F>
+void encodeFixed(
+    Buffer & buffer, I element, size_t count, const size_t elementSize,
+    const F & encode
+) {
+	const size_t perClaim = std::max<size_t>(1, buffer.capacity() / elementSize);
+	while (count > 0) {
+		size_t claimed = std::min(count, perClaim);
+		SpanBuffer span(buffer.claim(claimed * elementSize));
+		for (size_t i = 0; i < claimed; i++, ++element) {
+			encode(span, *element);
+		}
+		count -= claimed;
+	}
+}
+
 /* Integral leaf nodes for structured data representation. */
 class DataU8 {
 public:
@@ -39,11 +137,18 @@ public:
 	}
 };
 
+template <> constexpr size_t FIXED_SIZE<DataU8> = 1;
+
 Buffer & operator<<(Buffer & buffer, const DataU8 & data) {
 	buffer.writeU8(data.value);
 	return buffer;
 }
 
+SpanBuffer & operator<<(SpanBuffer & span, const DataU8 & data) {
+	span.writeU8(data.value);
+	return span;
+}
+
 Buffer & operator>>(Buffer & buffer, DataU8 & data) {
 	data.value = buffer.readU8();
 	return buffer;
@@ -58,11 +163,18 @@ public:
 	}
 };
 
+template <> constexpr size_t FIXED_SIZE<DataU16> = 2;
+
 Buffer & operator<<(Buffer & buffer, const DataU16 & data) {
 	buffer.writeU16(data.value);
 	return buffer;
 }
 
+SpanBuffer & operator<<(SpanBuffer & span, const DataU16 & data) {
+	span.writeU16(data.value);
+	return span;
+}
+
 Buffer & operator>>(Buffer & buffer, DataU16 & data) {
 	data.value = buffer.readU16();
 	return buffer;
@@ -77,11 +189,18 @@ public:
 	}
 };
 
+template <> constexpr size_t FIXED_SIZE<DataU32> = 4;
+
 Buffer & operator<<(Buffer & buffer, const DataU32 & data) {
 	buffer.writeU32(data.value);
 	return buffer;
 }
 
+SpanBuffer & operator<<(SpanBuffer & span, const DataU32 & data) {
+	span.writeU32(data.value);
+	return span;
+}
+
 Buffer & operator>>(Buffer & buffer, DataU32 & data) {
 	data.value = buffer.readU32();
 	return buffer;
@@ -104,7 +223,7 @@ Buffer & operator<<(Buffer & buffer, const DataString & data) {
 }
 
 Buffer & operator>>(Buffer & buffer, DataString & data) {
-	data.value = buffer.readStr(buffer.readU8());
+	buffer.readStr(buffer.readU8(), data.value);
 	return buffer;
 }
 
@@ -117,19 +236,54 @@ public:
 template <Data T>
 Buffer & operator<<(Buffer & buffer, const DataList<T> & data) {
 	buffer.writeU32((uint32_t)data.list.size());
-	for (const T & i : data.list) {
-		buffer << i;
+	if constexpr (FIXED_SIZE<T> > 0) {
+		encodeFixed(
+		    buffer, data.list.begin(), data.list.size(), FIXED_SIZE<T>,
+		    [](SpanBuffer & span, const T & i) {
+			    span << i;
+		    }
+		);
+	} else {
+		for (const T & i : data.list) {
+			buffer << i;
+		}
 	}
 	return buffer;
 }
 
+/*
+ * Clears a list element before it is decoded into again, so that fields the new
+ * element does not decode hold no values of the old one. Elements holding lists
+ * of their own clear them instead, keeping their memory.
+ */
+template <typename T> void resetData(T & data) {
+	data = T();
+}
+
+template <Data T> void resetData(DataList<T> & data) {
+	data.list.clear();
+}
+
+/*
+ * Elements are decoded in place, so that when the same list is decoded into
+ * again, the elements keep whatever memory they hold, such as nested lists.
+ * Decoding a list no longer than the previous one then does not allocate.
+ * Each reused element is reset first. The length is not trusted to reserve
+ * more than DATA_LIST_RESERVE_MAX.
+ */
+const size_t DATA_LIST_RESERVE_MAX = 1 << 12;
+
 template <Data T> Buffer & operator>>(Buffer & buffer, DataList<T> & data) {
 	size_t size = buffer.readU32();
-	data.list.clear();
-	for (size_t i = 0; i < size; i++) {
-		T t;
-		buffer >> t;
-		data.list.push_back(t);
+	data.list.reserve(std::min(size, DATA_LIST_RESERVE_MAX));
+	size_t reused = std::min(size, data.list.size());
+	for (size_t i = 0; i < reused; i++) {
+		resetData(data.list[i]);
+		buffer >> data.list[i];
+	}
+	data.list.resize(reused);
+	for (size_t i = reused; i < size; i++) {
+		buffer >> data.list.emplace_back();
 	}
 	return buffer;
 }
@@ -143,8 +297,17 @@ public:
 template <ComparableData T>
 Buffer & operator<<(Buffer & buffer, const DataSet<T> & data) {
 	buffer.writeU32((uint32_t)data.set.size());
-	for (const T & i : data.set) {
-		buffer << i;
+	if constexpr (FIXED_SIZE<T> > 0) {
+		encodeFixed(
+		    buffer, data.set.begin(), data.set.size(), FIXED_SIZE<T>,
+		    [](SpanBuffer & span, const T & i) {
+			    span << i;
+		    }
+		);
+	} else {
+		for (const T & i : data.set) {
+			buffer << i;
+		}
 	}
 	return buffer;
 }
@@ -170,8 +333,17 @@ public:
 template <ComparableData K, Data V>
 Buffer & operator<<(Buffer & buffer, const DataMap<K, V> & data) {
 	buffer.writeU32((uint32_t)data.map.size());
-	for (const auto & i : data.map) {
-		buffer << i.first << i.second;
+	if constexpr (FIXED_SIZE<K> > 0 && FIXED_SIZE<V> > 0) {
+		encodeFixed(
+		    buffer, data.map.begin(), data.map.size(), FIXED_SIZE<K> + FIXED_SIZE<V>,
+		    [](SpanBuffer & span, const auto & i) {
+			    span << i.first << i.second;
+		    }
+		);
+	} else {
+		for (const auto & i : data.map) {
+			buffer << i.first << i.second;
+		}
 	}
 	return buffer;
 }
@@ -216,13 +388,11 @@ public:
 	}
 };
 
-Buffer & operator<<(Buffer & buffer, const DataPlayer & data) {
-	return buffer << data.name << data.address;
-}
-
-Buffer & operator>>(Buffer & buffer, DataPlayer & data) {
-	return buffer >> data.name >> data.address;
-}
+template <> class DataFields<DataPlayer> {
+public:
+	static constexpr auto fields =
+	    std::make_tuple(&DataPlayer::name, &DataPlayer::address);
+};
 
 enum class DirectionEnum : uint8_t {
 	Up = 0,
@@ -236,11 +406,18 @@ public:
 	DirectionEnum direction{0};
 };
 
+template <> constexpr size_t FIXED_SIZE<DataDirection> = 1;
+
 Buffer & operator<<(Buffer & buffer, const DataDirection & data) {
 	buffer.writeU8(static_cast<uint8_t>(data.direction));
 	return buffer;
 }
 
+SpanBuffer & operator<<(SpanBuffer & span, const DataDirection & data) {
+	span.writeU8(static_cast<uint8_t>(data.direction));
+	return span;
+}
+
 Buffer & operator>>(Buffer & buffer, DataDirection & data) {
 	uint8_t enumValue = buffer.readU8();
 	if (enumValue > 3) {
@@ -266,13 +443,13 @@ public:
 	}
 };
 
-Buffer & operator<<(Buffer & buffer, const DataPosition & data) {
-	return buffer << data.x << data.y;
-}
+template <> class DataFields<DataPosition> {
+public:
+	static constexpr auto fields =
+	    std::make_tuple(&DataPosition::x, &DataPosition::y);
+};
 
-Buffer & operator>>(Buffer & buffer, DataPosition & data) {
-	return buffer >> data.x >> data.y;
-}
+static_assert(FIXED_SIZE<DataPosition> == 4);
 
 class DataBomb {
 public:
@@ -290,21 +467,32 @@ public:
 	}
 };
 
-Buffer & operator<<(Buffer & buffer, const DataBomb & data) {
-	return buffer << data.position << data.timer;
-}
+template <> class DataFields<DataBomb> {
+public:
+	static constexpr auto fields =
+	    std::make_tuple(&DataBomb::position, &DataBomb::timer);
+};
 
-Buffer & operator>>(Buffer & buffer, DataBomb & data) {
-	return buffer >> data.position >> data.timer;
-}
+static_assert(FIXED_SIZE<DataBomb> == 6);
 
 enum class EventEnum : uint8_t {
 	BombPlaced = 0,
 	BombExploded = 1,
 	PlayerMoved = 2,
-	BlockPlaced = 3
+	BlockPlaced = 3,
+	BlockField = 4,
+	ScoreChanged = 5
 };
 
+/*
+ * BlockField places many blocks at once, only sent by servers which were asked
+ * to. It is a list of bytes, a bitmap of the whole board with a bit for each
+ * cell, indexed column by column like x * sizeY + y, lowest bit of each byte
+ * first.
+ * ScoreChanged sets the score of a player, instead of counting its deaths. It
+ * is only sent with snapshots, by servers which were asked to take them, to
+ * clients which join a game late.
+ */
 class DataEvent {
 public:
 	EventEnum type{0};
@@ -314,11 +502,21 @@ public:
 	DataList<DataU8> playersDestroyed;
 	DataList<DataPosition> blocksDestroyed;
 	DataU8 playerID;
+	DataU32 score;
+	DataList<DataU8> blockField;
 };
 
+void resetData(DataEvent & data) {
+	data.type = EventEnum{0};
+	data.bombID = {}, data.position = {}, data.playerID = {}, data.score = {};
+	resetData(data.playersDestroyed);
+	resetData(data.blocksDestroyed);
+	resetData(data.blockField);
+}
+
 Buffer & operator>>(Buffer & buffer, DataEvent & data) {
 	uint8_t enumValue = buffer.readU8();
-	if (enumValue > 3) {
+	if (enumValue > 5) {
 		throw BadType();
 	}
 	data.type = static_cast<EventEnum>(enumValue);
@@ -332,6 +530,10 @@ Buffer & operator>>(Buffer & buffer, DataEvent & data) {
 		return buffer >> data.playerID >> data.position;
 	case EventEnum::BlockPlaced:
 		return buffer >> data.position;
+	case EventEnum::BlockField:
+		return buffer >> data.blockField;
+	case EventEnum::ScoreChanged:
+		return buffer >> data.playerID >> data.score;
 	default:
 		return buffer;
 	}
@@ -349,6 +551,10 @@ Buffer & operator<<(Buffer & buffer, const DataEvent & data) {
 		return buffer << data.playerID << data.position;
 	case EventEnum::BlockPlaced:
 		return buffer << data.position;
+	case EventEnum::BlockField:
+		return buffer << data.blockField;
+	case EventEnum::ScoreChanged:
+		return buffer << data.playerID << data.score;
 	default:
 		return buffer;
 	}
@@ -376,7 +582,8 @@ enum class ClientMessageEnum : uint8_t {
 	Join = 0,
 	PlaceBomb = 1,
 	PlaceBlock = 2,
-	Move = 3
+	Move = 3,
+	Compress = 4
 };
 
 class DataClientMessage {
@@ -401,7 +608,7 @@ Buffer & operator<<(Buffer & buffer, const DataClientMessage & data) {
 Buffer & operator>>(Buffer & buffer, DataClientMessage & data) {
 	buffer >> Buffer::eReceive;
 	uint8_t enumValue = buffer.readU8();
-	if (enumValue > 3) {
+	if (enumValue > 4) {
 		throw BadType();
 	}
 	data.type = static_cast<ClientMessageEnum>(enumValue);
@@ -420,7 +627,8 @@ enum class ServerMessageEnum : uint8_t {
 	AcceptedPlayer = 1,
 	GameStarted = 2,
 	Turn = 3,
-	GameEnded = 4
+	GameEnded = 4,
+	Compressed = 5
 };
 
 class DataServerMessage {
@@ -462,12 +670,90 @@ Buffer & operator<<(Buffer & buffer, const DataServerMessage & data) {
 	}
 }
 
+/*
+ * A Compressed message wraps one whole encoded server message, compressed with
+ * zlib. After its type come the lengths of the message and of the compressed
+ * bytes (32 bits each), then the compressed bytes. The server only sends them
+ * to clients which asked for them with a Compress message, and they are decoded
+ * as the message they wrap.
+ */
+const size_t COMPRESSED_HEADER_SIZE = sizeof(uint8_t) + 2 * sizeof(uint32_t);
+const uint32_t COMPRESSED_LENGTH_MAX = 1 << 26;
+
+/*
+ * Compresses `message`, one encoded server message, into a Compressed message.
+ * Leaves `compressed` empty when that would not make the message shorter.
+ */
+void compressMessage(
+    std::span<const char> message, std::vector<char> & compressed
+) {
+	uLongf length = compressBound(uLong(message.size()));
+	compressed.resize(COMPRESSED_HEADER_SIZE + length);
+	if (compress2(
+	        reinterpret_cast<Bytef *>(compressed.data() + COMPRESSED_HEADER_SIZE),
+	        &length, reinterpret_cast<const Bytef *>(message.data()),
+	        uLong(message.size()), Z_BEST_SPEED
+	    ) != Z_OK ||
+	    COMPRESSED_HEADER_SIZE + length >= message.size()) {
+		compressed.clear();
+		return;
+	}
+	compressed.resize(COMPRESSED_HEADER_SIZE + length);
+	SpanBuffer header(compressed.data());
+	header.writeU8(static_cast<uint8_t>(ServerMessageEnum::Compressed));
+	header.writeU32(uint32_t(message.size()));
+	header.writeU32(uint32_t(length));
+}
+
+Buffer & operator>>(Buffer & buffer, DataServerMessage & data);
+
+/* Decodes the message wrapped in a Compressed one, whose type was read. */
+Buffer & readCompressed(Buffer & buffer, DataServerMessage & data) {
+	uint32_t length = buffer.readU32();
+	uint32_t compressedLength = buffer.readU32();
+	if (length == 0 || length > COMPRESSED_LENGTH_MAX ||
+	    compressedLength > COMPRESSED_LENGTH_MAX) {
+		throw BadType();
+	}
+	std::string compressed;
+	buffer.readStr(compressedLength, compressed);
+
+	MemoryBuffer message(length);
+	uLongf written = length;
+	if (uncompress(
+	        reinterpret_cast<Bytef *>(message.prepare(length)), &written,
+	        reinterpret_cast<const Bytef *>(compressed.data()), compressedLength
+	    ) != Z_OK ||
+	    written != length) {
+		throw BadType();
+	}
+	message.commit(length);
+	if (ServerMessageEnum(uint8_t(*message.data())) ==
+	    ServerMessageEnum::Compressed) {
+		throw BadType();
+	}
+	// The wrapped message is whole, so it cannot be cut short.
+	try {
+		message >> data;
+	} catch (BadRead & e) {
+		throw BadType();
+	}
+	if (message.length() != 0) {
+		throw BadType();
+	}
+	return buffer >> Buffer::eEnd;
+}
+
 Buffer & operator>>(Buffer & buffer, DataServerMessage & data) {
 	buffer >> Buffer::eReceive;
 	uint8_t enumValue = buffer.readU8();
-	if (enumValue > 4) {
+	if (enumValue > 5) {
 		throw BadType();
 	}
+	if (static_cast<ServerMessageEnum>(enumValue) ==
+	    ServerMessageEnum::Compressed) {
+		return readCompressed(buffer, data);
+	}
 	data.type = static_cast<ServerMessageEnum>(enumValue);
 	switch (data.type) {
 	case ServerMessageEnum::Hello:
@@ -493,9 +779,17 @@ Buffer & operator>>(Buffer & buffer, DataServerMessage & data) {
  * =============================================================================
  */
 
+/*
+ * GameDelta is only sent to GUIs which asked for it. It carries what changed
+ * since the previous frame: positions of the players which moved, blocks placed
+ * and destroyed, and scores which changed. Bombs and explosions are sent in
+ * full, as they change every turn anyway. Every few frames, a full Game frame
+ * is sent instead, for the GUI to resynchronize.
+ */
 enum class DrawMessageEnum : uint8_t {
 	Lobby = 0,
-	Game = 1
+	Game = 1,
+	GameDelta = 2
 };
 
 class DataDrawMessage {
@@ -516,6 +810,11 @@ public:
 	DataList<DataBomb> bombs;
 	DataSet<DataPosition> explosions;
 	DataMap<DataU8, DataU32> scores;
+	// Changes since the previous frame, for GameDelta.
+	DataMap<DataU8, DataPosition> playersMoved;
+	DataSet<DataPosition> blocksPlaced;
+	DataSet<DataPosition> blocksDestroyed;
+	DataMap<DataU8, DataU32> scoresChanged;
 };
 
 Buffer & operator<<(Buffer & buffer, const DataDrawMessage & data) {
@@ -530,6 +829,10 @@ Buffer & operator<<(Buffer & buffer, const DataDrawMessage & data) {
 		              << data.gameLength << data.turn << data.players
 		              << data.playerPositions << data.blocks << data.bombs
 		              << data.explosions << data.scores << Buffer::eSend;
+	case DrawMessageEnum::GameDelta:
+		return buffer << data.turn << data.playersMoved << data.blocksPlaced
+		              << data.blocksDestroyed << data.bombs << data.explosions
+		              << data.scoresChanged << Buffer::eSend;
 	default:
 		return buffer;
 	}
@@ -538,7 +841,7 @@ Buffer & operator<<(Buffer & buffer, const DataDrawMessage & data) {
 Buffer & operator>>(Buffer & buffer, DataDrawMessage & data) {
 	buffer >> Buffer::eReceive;
 	uint8_t enumValue = buffer.readU8();
-	if (enumValue > 1) {
+	if (enumValue > 2) {
 		throw BadType();
 	}
 	data.type = static_cast<DrawMessageEnum>(enumValue);
@@ -552,6 +855,10 @@ Buffer & operator>>(Buffer & buffer, DataDrawMessage & data) {
 		       data.gameLength >> data.turn >> data.players >>
 		       data.playerPositions >> data.blocks >> data.bombs >>
 		       data.explosions >> data.scores >> Buffer::eEnd;
+	case DrawMessageEnum::GameDelta:
+		return buffer >> data.turn >> data.playersMoved >> data.blocksPlaced >>
+		       data.blocksDestroyed >> data.bombs >> data.explosions >>
+		       data.scoresChanged >> Buffer::eEnd;
 	default:
 		return buffer;
 	}
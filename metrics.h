@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * =============================================================================
+ *                              MetricsWriter
+ * =============================================================================
+ */
+
+/*
+ * Writes metrics in the Prometheus text format. Samples of one metric must be
+ * listed together, so they are collected per metric, in the order in which the
+ * metrics were first described, and then written out as a whole.
+ */
+class MetricsWriter {
+private:
+	class Family {
+	public:
+		std::string name;
+		std::stringstream text;
+	};
+
+	std::vector<Family> families;
+
+	Family & find(const std::string & name) {
+		for (Family & family : families) {
+			if (family.name == name) {
+				return family;
+			}
+		}
+		throw std::invalid_argument("Metric " + name + " was not described.");
+	}
+
+public:
+	/* Describes a metric, `type` is counter or gauge. Repeats are ignored. */
+	void describe(
+	    const std::string & name, const std::string & type,
+	    const std::string & help
+	) {
+		for (const Family & family : families) {
+			if (family.name == name) {
+				return;
+			}
+		}
+		Family & family = families.emplace_back();
+		family.name = name;
+		family.text << "# HELP " << name << " " << help << "\n# TYPE " << name
+		            << " " << type << "\n";
+	}
+
+	/* Adds a sample of a described metric, `labels` as in key="value",... */
+	template <typename T>
+	void sample(const std::string & name, const std::string & labels, T value) {
+		Family & family = find(name);
+		family.text << name;
+		if (!labels.empty()) {
+			family.text << "{" << labels << "}";
+		}
+		family.text << " " << value << "\n";
+	}
+
+	[[nodiscard]] std::string str() const {
+		std::string result;
+		for (const Family & family : families) {
+			result += family.text.str();
+		}
+		return result;
+	}
+};
+
+/*
+ * =============================================================================
+ *                               RoomMetrics
+ * =============================================================================
+ */
+
+/*
+ * Counters of a room, bumped by the game and by the connections' handlers on
+ * any thread, and read whenever metrics are scraped. They are only counters, so
+ * relaxed atomics are enough. Turn times come from the room's TurnScheduler.
+ */
+class RoomMetrics {
+public:
+	using Counter = std::atomic<uint64_t>;
+
+	Counter turns = 0;
+	Counter overruns = 0;
+	Counter processingNanos = 0;
+	Counter latenessNanos = 0;
+	Counter lastProcessingNanos = 0;
+	Counter maxProcessingNanos = 0;
+	Counter events = 0;
+	Counter lastTurnBytes = 0;
+	// Bytes of all messages put in the queue, each of them is sent to everyone.
+	Counter bytesQueued = 0;
+	Counter bytesSent = 0;
+	Counter bytesReceived = 0;
+	Counter messagesReceived = 0;
+	Counter backlogDisconnects = 0;
+
+	static void add(Counter & counter, uint64_t value) {
+		counter.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	static uint64_t get(const Counter & counter) {
+		return counter.load(std::memory_order_relaxed);
+	}
+
+	/* Records a turn, only ever called by the game, one turn at a time. */
+	void recordTurn(
+	    std::chrono::steady_clock::duration lateness,
+	    std::chrono::steady_clock::duration processing, bool overrun,
+	    uint64_t turnEvents, uint64_t turnBytes
+	) {
+		auto nanos = [](std::chrono::steady_clock::duration duration) {
+			return uint64_t(
+			    std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()
+			);
+		};
+		add(turns, 1);
+		add(overruns, overrun);
+		add(processingNanos, nanos(processing));
+		add(latenessNanos, nanos(lateness));
+		lastProcessingNanos.store(nanos(processing), std::memory_order_relaxed);
+		if (nanos(processing) > get(maxProcessingNanos)) {
+			maxProcessingNanos.store(nanos(processing), std::memory_order_relaxed);
+		}
+		add(events, turnEvents);
+		lastTurnBytes.store(turnBytes, std::memory_order_relaxed);
+	}
+};
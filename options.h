@@ -12,12 +12,33 @@ getClientOptionsDescription() {
 	if (!initialized) {
 		clientOptionsDescription.add_options()(
 		    "help,h", "Display this help message"
+		)("catch-up",
+		  "Draw no frames while more messages from the server are already waiting, "
+		  "as when connecting in the middle of a game, only one when they are all "
+		  "applied"
+		)("coalesce-inputs", value<std::string>()->default_value("off"),
+		  "How moves from the GUI are sent to the server: off sends each of them, "
+		  "turn sends at most one per turn and a number sends at most one per "
+		  "that many milliseconds, the latest move replacing any waiting one"
+		)("compress",
+		  "Ask the server to send long messages compressed, if it compresses them"
 		)("gui-address,d", value<std::string>()->required(),
 		  "The address of the GUI server"
+		)("gui-transport", value<std::string>()->default_value("udp"),
+		  "The protocol used to talk to the GUI, udp or tcp. Over tcp, the client "
+		  "connects to the GUI, and frames of any size are streamed"
+		)("gui-delta", value<uint16_t>()->default_value(0),
+		  "Send the GUI only changes between frames, with a full frame every given "
+		  "number of frames (0 always sends full frames)"
 		)("player-name,n", value<std::string>()->required(),
 		  "The name identifying you in the game"
 		)("port,p", value<port_t>()->required(),
 		  "The port on which the client will be listening"
+		)("predict-moves",
+		  "Show your own moves to the GUI right away, before the server confirms "
+		  "them"
+		)("receive-buffer", value<size_t>()->default_value(1 << 16),
+		  "The number of bytes read ahead from the server at most"
 		)("server-address,s", value<std::string>()->required(),
 		  "The address of the game server");
 
@@ -27,6 +48,9 @@ getClientOptionsDescription() {
 	return clientOptionsDescription;
 }
 
+// The default file of the server's trace, see trace.h.
+const std::string TRACE_FILE = "robots-server.trace.json";
+
 const boost::program_options::options_description &
 getServerOptionsDescription() {
 	using namespace boost::program_options;
@@ -43,6 +67,8 @@ getServerOptionsDescription() {
 		  "The duration of one turn in milliseconds"
 		)("explosion-radius,e", value<uint16_t>()->required(),
 		  "The radius of explosions"
+		)("game-threads,g", value<uint16_t>()->default_value(1),
+		  "The number of threads running the games"
 		)("initial-blocks,k", value<uint16_t>()->required(),
 		  "The initial number of blocks on the board"
 		)("game-length,l", value<uint16_t>()->required(),
@@ -51,8 +77,42 @@ getServerOptionsDescription() {
 		  "The name of the server"
 		)("port,p", value<port_t>()->required(),
 		  "The port on which the server will be listening"
+		)("rooms,r", value<uint16_t>()->default_value(1),
+		  "The number of games hosted at the same time"
 		)("seed,s", value<uint32_t>()->default_value(uint32_t(std::chrono::system_clock::now().time_since_epoch().count())),
 		  "The seed to be used during randomization (default is 0)"
+		)("io-threads,t", value<uint16_t>()->default_value(1),
+		  "The number of threads handling client connections"
+		)("block-field",
+		  "Send the blocks of a new game, and of snapshots, as one bitmap of the "
+		  "board when that is shorter than an event for each block. Clients "
+		  "which do not know BlockField events cannot follow such games"
+		)("compression-threshold", value<uint32_t>()->default_value(0),
+		  "The number of bytes from which messages are sent compressed to "
+		  "clients which ask for it (0 disables compression)"
+		)("max-backlog", value<uint32_t>()->default_value(0),
+		  "The number of messages a client may fall behind before being "
+		  "disconnected (0 means no limit)"
+		)("metrics-port", value<port_t>()->default_value(0),
+		  "The port on which metrics are served over HTTP, in the Prometheus text "
+		  "format (0 disables metrics)"
+		)("record", value<std::string>(),
+		  "The file to record all games to, for replaying them later. With more "
+		  "than one room, each room records to its own file, named with the "
+		  "room's number appended"
+		)("simulation-threads", value<uint16_t>()->default_value(1),
+		  "The number of threads casting the explosions of one turn, when many "
+		  "bombs explode at once (1 keeps each turn on one thread)"
+		)("snapshot-interval", value<uint16_t>()->default_value(0),
+		  "The number of turns after which new clients get a snapshot of the "
+		  "game instead of its full history, with ScoreChanged events which "
+		  "only clients that know them can follow (0 disables snapshots)"
+		)("spin-time", value<uint64_t>()->default_value(0),
+		  "The number of microseconds before each turn spent busy-waiting instead "
+		  "of sleeping, for more precise turns, ignored with more than one room"
+		)("trace-file", value<std::string>()->default_value(TRACE_FILE),
+		  "Where builds with tracing (make TRACE=1) write the latest turns and "
+		  "sends, in the Chrome trace format, on SIGUSR1 and at shutdown"
 		)("size-x,x", value<uint16_t>()->required(),
 		  "The horizontal size of the board"
 		)("size-y,y", value<uint16_t>()->required(),
@@ -64,6 +124,83 @@ getServerOptionsDescription() {
 	return serverOptionsDescription;
 }
 
+/* Options of the server when it replays recorded games instead. */
+const boost::program_options::options_description &
+getReplayOptionsDescription() {
+	using namespace boost::program_options;
+	static options_description replayOptionsDescription("Replay options");
+	static bool initialized = false;
+
+	if (!initialized) {
+		replayOptionsDescription.add_options()(
+		    "help,h", "Display this help message"
+		)("port,p", value<port_t>()->required(),
+		  "The port on which the server will be listening"
+		)("io-threads,t", value<uint16_t>()->default_value(1),
+		  "The number of threads handling client connections"
+		)("max-backlog", value<uint32_t>()->default_value(0),
+		  "The number of messages a client may fall behind before being "
+		  "disconnected (0 means no limit)"
+		)("metrics-port", value<port_t>()->default_value(0),
+		  "The port on which metrics are served over HTTP, in the Prometheus text "
+		  "format (0 disables metrics)"
+		)("replay", value<std::string>()->required(),
+		  "The recorded games to serve, in turn, while anyone is connected"
+		)("replay-speed", value<double>()->default_value(1),
+		  "How many times faster than recorded games are replayed (0 replays "
+		  "them as fast as possible)"
+		)("spin-time", value<uint64_t>()->default_value(0),
+		  "The number of microseconds before each turn spent busy-waiting instead "
+		  "of sleeping, for more precise turns"
+		)("trace-file", value<std::string>()->default_value(TRACE_FILE),
+		  "Where builds with tracing (make TRACE=1) write the latest turns and "
+		  "sends, in the Chrome trace format, on SIGUSR1 and at shutdown");
+
+		initialized = true;
+	}
+
+	return replayOptionsDescription;
+}
+
+const boost::program_options::options_description &
+getLoadOptionsDescription() {
+	using namespace boost::program_options;
+	static options_description loadOptionsDescription("Load generator options");
+	static bool initialized = false;
+
+	if (!initialized) {
+		loadOptionsDescription.add_options()(
+		    "help,h", "Display this help message"
+		)("connections,c", value<uint16_t>()->required(),
+		  "The number of connections opened to the server"
+		)("turn-duration,d", value<uint64_t>()->required(),
+		  "The duration of one turn in milliseconds, as set on the server"
+		)("games,g", value<uint16_t>()->default_value(1),
+		  "The number of games each connection stays for (0 means until "
+		  "interrupted)"
+		)("players,m", value<uint16_t>()->default_value(0),
+		  "The number of connections which join games as players, the others "
+		  "only observe"
+		)("player-name,n", value<std::string>()->default_value("load"),
+		  "The name players join with, followed by their number"
+		)("per-connection", "Report the statistics of every connection as well"
+		)("script", value<std::string>()->default_value(""),
+		  "The moves players make, one per turn and repeated, from b (bomb), k "
+		  "(block), u, r, d and l (moves). Each player starts at a different "
+		  "move. Without a script, moves are random"
+		)("seed", value<uint32_t>()->default_value(0),
+		  "The seed of random moves"
+		)("server-address,s", value<std::string>()->required(),
+		  "The address of the game server"
+		)("threads,t", value<uint16_t>()->default_value(1),
+		  "The number of threads handling the connections");
+
+		initialized = true;
+	}
+
+	return loadOptionsDescription;
+}
+
 boost::program_options::variables_map parseOptions(
     int argc, char ** argv,
     const boost::program_options::options_description & optionsDescription
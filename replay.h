@@ -0,0 +1,192 @@
+#pragma once
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "exceptions.h"
+#include "messages.h"
+
+/*
+ * =============================================================================
+ *                               Replay files
+ * =============================================================================
+ */
+
+/*
+ * A replay file holds server messages exactly as they were sent. After the
+ * magic string and the turn duration in milliseconds (64 bits), each message
+ * is stored as its length (32 bits) followed by its bytes, all big-endian. The
+ * first message is Hello, then each game follows: GameStarted, its turns, and
+ * GameEnded.
+ */
+const char REPLAY_MAGIC[8] = {'R', 'O', 'B', 'O', 'T', 'S', 'R', '1'};
+
+/* Appends messages to a new replay file, which replaces any older one. */
+class ReplayWriter {
+private:
+	std::ofstream file;
+
+	void writeBigEndian(uint64_t value, size_t bytes) {
+		char encoded[8];
+		value = htobe64(value);
+		memcpy(encoded, &value, sizeof(value));
+		file.write(encoded + sizeof(value) - bytes, std::streamsize(bytes));
+	}
+
+public:
+	ReplayWriter(
+	    const std::string & path, std::span<const char> hello,
+	    uint64_t turnDuration
+	) :
+	    file(path, std::ios::binary | std::ios::trunc) {
+		if (!file) {
+			throw RobotsException(
+			    "Error: could not open " + path + " for writing.\n"
+			);
+		}
+		file.write(REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+		writeBigEndian(turnDuration, sizeof(uint64_t));
+		write(hello);
+	}
+
+	void write(std::span<const char> message) {
+		writeBigEndian(message.size(), sizeof(uint32_t));
+		file.write(message.data(), std::streamsize(message.size()));
+	}
+
+	/* Writes out what is buffered, called at the end of each game. */
+	void flush() {
+		file.flush();
+	}
+};
+
+/*
+ * A replay file mapped into memory, with its messages indexed. Only whole
+ * games are kept: GameStarted, turns numbered from 0 one by one, and GameEnded.
+ * A game cut off by the end of the file, as when the server was stopped in the
+ * middle of it, or otherwise broken, is left out.
+ */
+class ReplayFile {
+private:
+	const char * mapping = nullptr;
+	size_t mappingSize = 0;
+
+public:
+	using Message = std::span<const char>;
+
+	uint64_t turnDuration = 0;
+	Message hello;
+	std::vector<std::vector<Message>> games;
+
+	explicit ReplayFile(const std::string & path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw RobotsException("Error: could not open " + path + ".\n");
+		}
+		struct stat status {};
+		if (fstat(fd, &status) == 0 && status.st_size > 0) {
+			mappingSize = size_t(status.st_size);
+			void * mapped =
+			    mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped != MAP_FAILED) {
+				mapping = static_cast<const char *>(mapped);
+			}
+		}
+		close(fd);
+		if (!mapping || mappingSize < sizeof(REPLAY_MAGIC) + sizeof(uint64_t) ||
+		    memcmp(mapping, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0) {
+			unmap();
+			throw RobotsException("Error: " + path + " is not a replay file.\n");
+		}
+		index();
+		if (hello.empty() ||
+		    ServerMessageEnum(uint8_t(hello[0])) != ServerMessageEnum::Hello) {
+			unmap();
+			throw RobotsException("Error: " + path + " has no Hello message.\n");
+		}
+	}
+
+	ReplayFile(const ReplayFile &) = delete;
+	ReplayFile & operator=(const ReplayFile &) = delete;
+
+	~ReplayFile() {
+		unmap();
+	}
+
+private:
+	[[nodiscard]] uint64_t readBigEndian(size_t offset, size_t bytes) const {
+		uint64_t value = 0;
+		memcpy(reinterpret_cast<char *>(&value) + sizeof(value) - bytes,
+		       mapping + offset, bytes);
+		return be64toh(value);
+	}
+
+	// The number of a Turn message, if it is long enough to have one.
+	[[nodiscard]] static std::optional<uint16_t> turnNumber(Message message) {
+		if (message.size() < sizeof(uint8_t) + sizeof(uint16_t)) {
+			return std::nullopt;
+		}
+		return uint16_t(uint8_t(message[1]) << 8 | uint8_t(message[2]));
+	}
+
+	void index() {
+		size_t offset = sizeof(REPLAY_MAGIC);
+		turnDuration = readBigEndian(offset, sizeof(uint64_t));
+		offset += sizeof(uint64_t);
+
+		std::vector<Message> game;
+		while (offset + sizeof(uint32_t) <= mappingSize) {
+			size_t length = readBigEndian(offset, sizeof(uint32_t));
+			offset += sizeof(uint32_t);
+			if (length == 0 || length > mappingSize - offset) {
+				break;
+			}
+			Message message(mapping + offset, length);
+			offset += length;
+
+			switch (ServerMessageEnum(uint8_t(message[0]))) {
+			case ServerMessageEnum::Hello:
+				hello = message;
+				break;
+			case ServerMessageEnum::GameStarted:
+				game.assign(1, message);
+				break;
+			case ServerMessageEnum::Turn:
+				// Turns follow the game's start, numbered one by one.
+				if (!game.empty() && turnNumber(message) == game.size() - 1) {
+					game.push_back(message);
+				} else {
+					game.clear();
+				}
+				break;
+			case ServerMessageEnum::GameEnded:
+				// A game has at least turn 0 between its start and end.
+				if (game.size() >= 2) {
+					game.push_back(message);
+					games.push_back(std::move(game));
+				}
+				game.clear();
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	void unmap() {
+		if (mapping) {
+			munmap(const_cast<char *>(mapping), mappingSize);
+			mapping = nullptr;
+		}
+	}
+};
@@ -1,13 +1,18 @@
 #include <boost/asio.hpp>
+#include <atomic>
 #include <boost/program_options.hpp>
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <thread>
 #include <unordered_map>
 
 #include "buffer.h"
 #include "exceptions.h"
+#include "grid.h"
 #include "messages.h"
 #include "options.h"
 #include "utils.h"
@@ -41,21 +46,65 @@ namespace {
 
 		variables_map options;
 
+		/* Over TCP, both draw and input messages go through GUIStream. */
+		bool GUIOverTCP;
 		udp::resolver UDPResolver;
 		tcp::resolver TCPResolver;
 		udp::endpoint GUIEndpoint;
 		tcp::endpoint serverEndpoint;
 		udp::socket GUISocket;
+		tcp::socket GUIStream;
 		tcp::socket serverSocket;
 
-		/* Protection mostly for reading and writing to `state` member variable. */
+		/* Protection for the inputs, `state` is only changed by the server's. */
 		std::mutex variablesMutex;
-		GameState state;
+		std::atomic<GameState> state;
 		std::string playerName;
+		// Frames between full frames sent to the GUI, 0 disables delta frames.
+		uint16_t keyframeInterval;
+		static const size_t RECEIVE_BUFFER_MIN = 256;
+		size_t receiveBufferSize;
+
+		/*
+		 * Moves from the GUI can be coalesced: the latest one waits in a single
+		 * slot, replacing any earlier one, and is sent at most once per turn or
+		 * per interval. The server only keeps a player's last message of a turn
+		 * anyway. Joining is never held back. Guarded by variablesMutex, the
+		 * condition variable wakes up the thread sending by interval.
+		 */
+		enum class InputCoalescing { Off, Turn, Interval };
+		InputCoalescing inputCoalescing = InputCoalescing::Off;
+		std::chrono::milliseconds inputInterval{0};
+		bool inputPending = false;
+		bool inputSentThisTurn = false;
+		std::chrono::steady_clock::time_point lastInputSent;
+		std::condition_variable inputCV;
+		// Set with both mutexes held, when the client shuts down.
+		bool stopping = false;
+
+		bool predictMoves;
+		uint16_t localPort = 0;
+
+		/*
+		 * Frames go through a pipeline: the thread reading from the server applies
+		 * messages to the draw state and marks a frame as due, and the frame
+		 * thread encodes the latest state and sends it to the GUI. When the GUI
+		 * cannot keep up, frames which were never sent are skipped, and the next
+		 * one is a full frame. The draw state is guarded by drawMutex, which is
+		 * never held while sending, so inputs never wait for frames.
+		 */
+		static const size_t DATAGRAM_SIZE_MAX = 65507;
+		std::mutex drawMutex;
+		std::condition_variable frameCV;
+		size_t unsentFrames = 0;
+		// Whether frames were left out since the last one, as while catching up.
+		bool framesSkipped = false;
+		bool catchUp;
 
 		Client(int argc, char ** argv) :
 		    context(),
 		    options(handleOptions(argc, argv, getClientOptionsDescription())),
+		    GUIOverTCP(options["gui-transport"].as<std::string>() == "tcp"),
 		    UDPResolver(context), TCPResolver(context),
 		    GUIEndpoint(resolveAddress<udp::endpoint, udp::resolver>(
 		        UDPResolver, options["gui-address"].as<std::string>(),
@@ -68,17 +117,78 @@ namespace {
 		    GUISocket(udp::socket(
 		        context, udp::endpoint(udp::v6(), options["port"].as<port_t>())
 		    )),
-		    serverSocket(context), state(GameState::Lobby),
-		    playerName(options["player-name"].as<std::string>()) {
+		    GUIStream(context), serverSocket(context), state(GameState::Lobby),
+		    playerName(options["player-name"].as<std::string>()),
+		    keyframeInterval(options["gui-delta"].as<uint16_t>()),
+		    receiveBufferSize(options["receive-buffer"].as<size_t>()),
+		    predictMoves(options.count("predict-moves") > 0),
+		    catchUp(options.count("catch-up") > 0) {
+			const std::string & transport = options["gui-transport"].as<std::string>();
+			if (transport != "udp" && transport != "tcp") {
+				throw RobotsException(
+				    "Error: the argument ('" + transport +
+				    "') for option '--gui-transport' is invalid.\n" + "Run " +
+				    std::string(argv[0]) + " --help for usage.\n"
+				);
+			}
+			const std::string & coalescing =
+			    options["coalesce-inputs"].as<std::string>();
+			if (coalescing == "turn") {
+				inputCoalescing = InputCoalescing::Turn;
+			} else if (coalescing != "off") {
+				char * end = nullptr;
+				unsigned long long interval = strtoull(coalescing.c_str(), &end, 10);
+				if (coalescing.empty() || *end != '\0' || interval == 0) {
+					throw RobotsException(
+					    "Error: the argument ('" + coalescing +
+					    "') for option '--coalesce-inputs' is invalid.\n" + "Run " +
+					    std::string(argv[0]) + " --help for usage.\n"
+					);
+				}
+				inputCoalescing = InputCoalescing::Interval;
+				inputInterval = std::chrono::milliseconds(interval);
+			}
+			if (receiveBufferSize < RECEIVE_BUFFER_MIN) {
+				throw RobotsException(
+				    "Error: the argument ('" + std::to_string(receiveBufferSize) +
+				    "') for option '--receive-buffer' is invalid.\n" + "Run " +
+				    std::string(argv[0]) + " --help for usage.\n"
+				);
+			}
 			try {
 				serverSocket.connect(serverEndpoint);
 				boost::asio::ip::tcp::no_delay option(true);
 				serverSocket.set_option(option);
+				localPort = serverSocket.local_endpoint().port();
+				// Asked for before anything else, the server holds back for it.
+				if (options.count("compress")) {
+					TCPBuffer requestBuffer(serverSocket);
+					DataClientMessage request;
+					request.type = ClientMessageEnum::Compress;
+					requestBuffer << request;
+				}
+				if (GUIOverTCP) {
+					GUIStream.connect(resolveAddress<tcp::endpoint, tcp::resolver>(
+					    TCPResolver, options["gui-address"].as<std::string>(),
+					    std::string(argv[0])
+					));
+					GUIStream.set_option(option);
+				}
+			} catch (RobotsException & e) {
+				throw;
 			} catch (std::exception & e) {
 				throw RobotsException("Error: " + std::string(e.what()) + "\n");
 			}
 		}
 
+		/* Prepares the buffer for messages to or from the GUI. */
+		std::unique_ptr<Buffer> makeGUIBuffer() {
+			if (GUIOverTCP) {
+				return std::make_unique<TCPBuffer>(GUIStream);
+			}
+			return std::make_unique<UDPBuffer>(GUISocket, GUIEndpoint);
+		}
+
 	private:
 		DataClientMessage outClientMessage;
 
@@ -109,112 +219,345 @@ namespace {
 			return outClientMessage;
 		}
 
+		/*
+		 * Sends the message made of the latest GUI input, processed just before,
+		 * or leaves it waiting if a coalesced one went out too recently.
+		 */
+		void submitInput(Buffer & serverBuffer) {
+			bool due = true;
+			if (state == GameState::Game) {
+				switch (inputCoalescing) {
+				case InputCoalescing::Turn:
+					due = !inputSentThisTurn;
+					break;
+				case InputCoalescing::Interval:
+					due = std::chrono::steady_clock::now() - lastInputSent >=
+					      inputInterval;
+					break;
+				default:
+					break;
+				}
+			}
+			if (due) {
+				sendInput(serverBuffer);
+			} else {
+				inputPending = true;
+				inputCV.notify_one();
+			}
+		}
+
+		void sendInput(Buffer & serverBuffer) {
+			serverBuffer << outClientMessage;
+			inputPending = false;
+			inputSentThisTurn = true;
+			lastInputSent = std::chrono::steady_clock::now();
+		}
+
+		/*
+		 * Follows the game for coalesced inputs: a turn lets an input through
+		 * again, sending the waiting one, and the end of a game drops it.
+		 */
+		void followServerMessage(
+		    const DataServerMessage & inMessage, Buffer & serverBuffer
+		) {
+			if (inMessage.type == ServerMessageEnum::GameEnded) {
+				inputPending = false;
+			} else if (inMessage.type == ServerMessageEnum::Turn) {
+				inputSentThisTurn = false;
+				if (inputPending && inputCoalescing == InputCoalescing::Turn) {
+					sendInput(serverBuffer);
+				}
+			}
+		}
+
 	private:
 		DataDrawMessage outDrawMessage;
-
-		std::unordered_map<uint32_t, DataBomb> activeBombs;
+		// Delta frames sent since the last full frame.
+		uint16_t deltaFrames = 0;
+
+		/*
+		 * Blocks and explosions are kept in grids, and only turned into the sets of
+		 * the draw message when it is sent. Active bombs are kept in the list of
+		 * the draw message itself, indexed by ID.
+		 */
+		PositionGrid blocks;
+		PositionGrid explosions;
+		std::vector<DataPosition> explosionCells;
+		std::unordered_map<uint32_t, size_t> bombIndices;
+		std::vector<uint32_t> bombIDs;
 		std::set<uint8_t> destroyedPlayers;
 		std::set<DataPosition> destroyedBlocks;
 
+		/*
+		 * With prediction, a move is shown as soon as it is made, from where the
+		 * server last put the player. The server's position is shown again at
+		 * the next turn, unless the turn's events move the player anyway.
+		 */
+		std::optional<uint8_t> ownPlayerID;
+		DataPosition ownPosition;
+		bool predicted = false;
+
+		/* Finds this client among the players, by its name and port. */
+		void findOwnPlayer(const DataServerMessage & inMessage) {
+			ownPlayerID.reset();
+			std::string portSuffix = ":" + std::to_string(localPort);
+			for (const auto & [playerID, player] : inMessage.players.map) {
+				if (player.name.value == playerName &&
+				    player.address.value.ends_with(portSuffix)) {
+					ownPlayerID = playerID.value;
+				}
+			}
+		}
+
+		/* Whether the position is on the board, as positions from the server are
+		 * not trusted to index the grids. */
+		[[nodiscard]] bool onBoard(const DataPosition & position) const {
+			return position.x.value < outDrawMessage.sizeX.value &&
+			       position.y.value < outDrawMessage.sizeY.value;
+		}
+
+		/*
+		 * Marks the cells from the bomb in the given direction as explosions, up
+		 * to the first block or the edge, the block found by a scan of the grid.
+		 */
+		void castRay(const DataPosition & bombPosition, DirectionEnum direction) {
+			uint32_t length = blocks.cellsAlong(
+			    bombPosition, direction, outDrawMessage.explosionRadius.value + 1U
+			);
+			uint32_t blockStep = blocks.firstAlong(bombPosition, direction, length);
+			uint32_t reach = std::min(blockStep + 1, length);
+			for (uint32_t step = 0; step < reach; step++) {
+				DataPosition explosion =
+				    PositionGrid::along(bombPosition, direction, step);
+				if (explosions.insert(explosion)) {
+					explosionCells.push_back(explosion);
+				}
+			}
+		}
+
+		/* Moves the last bomb into the removed one's place. */
+		void removeBomb(uint32_t bombID) {
+			std::vector<DataBomb> & bombs = outDrawMessage.bombs.list;
+			size_t index = bombIndices[bombID];
+			bombs[index] = bombs.back();
+			bombIDs[index] = bombIDs.back();
+			bombIndices[bombIDs[index]] = index;
+			bombIndices.erase(bombID);
+			bombs.pop_back();
+			bombIDs.pop_back();
+		}
+
+		/*
+		 * Chooses between a full and a delta frame, a full one if the GUI missed
+		 * frames, and fills the sets of the draw message in one sorted pass, if
+		 * they are sent.
+		 */
+		void prepareDrawMessage(bool missedFrames) {
+			if (state != GameState::Game) {
+				return;
+			}
+			/* Send only the changes, unless a full frame is due. */
+			if (missedFrames) {
+				deltaFrames = keyframeInterval;
+			}
+			if (keyframeInterval > 0 && deltaFrames < keyframeInterval) {
+				outDrawMessage.type = DrawMessageEnum::GameDelta;
+				deltaFrames++;
+			} else {
+				outDrawMessage.type = DrawMessageEnum::Game;
+				deltaFrames = 0;
+			}
+			std::sort(explosionCells.begin(), explosionCells.end());
+			outDrawMessage.explosions.set.clear();
+			for (const DataPosition & explosion : explosionCells) {
+				outDrawMessage.explosions.set.insert(
+				    outDrawMessage.explosions.set.end(), explosion
+				);
+			}
+			if (outDrawMessage.type == DrawMessageEnum::Game) {
+				outDrawMessage.blocks.set.clear();
+				blocks.forEach([&](const DataPosition & block) {
+					outDrawMessage.blocks.set.insert(
+					    outDrawMessage.blocks.set.end(), block
+					);
+				});
+			}
+		}
+
 		void processTurnMessage(const DataServerMessage & inMessage) {
 			/* First, decrease counters on bombs and forget previous explosions. */
-			for (auto & entry : activeBombs) {
-				entry.second.timer.value--;
+			for (DataBomb & bomb : outDrawMessage.bombs.list) {
+				bomb.timer.value--;
+			}
+			for (const DataPosition & explosion : explosionCells) {
+				explosions.erase(explosion);
+			}
+			explosionCells.clear();
+			outDrawMessage.playersMoved.map.clear();
+			outDrawMessage.blocksPlaced.set.clear();
+			outDrawMessage.blocksDestroyed.set.clear();
+			outDrawMessage.scoresChanged.map.clear();
+			if (predicted) {
+				outDrawMessage.playerPositions.map[{*ownPlayerID}] = ownPosition;
+				outDrawMessage.playersMoved.map[{*ownPlayerID}] = ownPosition;
+				predicted = false;
 			}
-			outDrawMessage.explosions.set.clear();
 
 			/* Then, process the events. */
 			outDrawMessage.turn = inMessage.turn;
 			for (const DataEvent & event : inMessage.events.list) {
-				DataBomb bomb;
-				DataPosition bombPosition;
-				uint16_t radius, leftX, rightX, lowY, highY;
+				/* Skip events off the board. */
+				if ((event.type == EventEnum::BombPlaced ||
+				     event.type == EventEnum::PlayerMoved ||
+				     event.type == EventEnum::BlockPlaced) &&
+				    !onBoard(event.position)) {
+					continue;
+				}
+				auto bombIterator = bombIndices.end();
 				switch (event.type) {
 				case EventEnum::BombPlaced:
-					bomb.position = event.position;
-					bomb.timer = inMessage.bombTimer;
-					activeBombs[event.bombID.value] = bomb;
+					bombIndices[event.bombID.value] = outDrawMessage.bombs.list.size();
+					bombIDs.push_back(event.bombID.value);
+					outDrawMessage.bombs.list.push_back(
+					    {event.position, outDrawMessage.bombTimer}
+					);
 					break;
 				case EventEnum::BombExploded:
-					/* Get explosion bounds. */
-					bombPosition = activeBombs[event.bombID.value].position;
-					radius = outDrawMessage.explosionRadius.value;
-					leftX = uint16_t(std::max(0, bombPosition.x.value - radius));
-					rightX = uint16_t(std::min(
-					    outDrawMessage.sizeX.value - 1, bombPosition.x.value + radius
-					));
-					lowY = uint16_t(std::max(0, bombPosition.y.value - radius));
-					highY = uint16_t(std::min(
-					    outDrawMessage.sizeY.value - 1, bombPosition.y.value + radius
-					));
-					/* Add explosions. */
-					for (int x = bombPosition.x.value; x >= int(leftX); x--) {
-						DataPosition explosion = {{uint16_t(x)}, bombPosition.y};
-						outDrawMessage.explosions.set.insert(explosion);
-						if (outDrawMessage.blocks.set.contains(explosion)) {
-							break;
-						}
+					/* Add explosions, unless the bomb is unknown. */
+					bombIterator = bombIndices.find(event.bombID.value);
+					if (bombIterator != bombIndices.end()) {
+						DataPosition bombPosition =
+						    outDrawMessage.bombs.list[bombIterator->second].position;
+						castRay(bombPosition, DirectionEnum::Left);
+						castRay(bombPosition, DirectionEnum::Right);
+						castRay(bombPosition, DirectionEnum::Down);
+						castRay(bombPosition, DirectionEnum::Up);
+						/* Remove bomb from active bombs. */
+						removeBomb(event.bombID.value);
 					}
-					for (int x = bombPosition.x.value; x <= int(rightX); x++) {
-						DataPosition explosion = {{uint16_t(x)}, bombPosition.y};
-						outDrawMessage.explosions.set.insert(explosion);
-						if (outDrawMessage.blocks.set.contains(explosion)) {
-							break;
-						}
-					}
-					for (int y = bombPosition.y.value; y >= int(lowY); y--) {
-						DataPosition explosion = {bombPosition.x, {uint16_t(y)}};
-						outDrawMessage.explosions.set.insert(explosion);
-						if (outDrawMessage.blocks.set.contains(explosion)) {
-							break;
-						}
-					}
-					for (int y = bombPosition.y.value; y <= int(highY); y++) {
-						DataPosition explosion = {bombPosition.x, {uint16_t(y)}};
-						outDrawMessage.explosions.set.insert(explosion);
-						if (outDrawMessage.blocks.set.contains(explosion)) {
-							break;
-						}
-					}
-					/* Remove bomb from active bombs. */
-					activeBombs.erase(event.bombID.value);
 					/* Save destroyed players. */
 					for (const DataU8 & playerID : event.playersDestroyed.list) {
 						destroyedPlayers.insert(playerID.value);
 					}
 					/* Save destroyed blocks. */
 					for (const DataPosition & block : event.blocksDestroyed.list) {
-						destroyedBlocks.insert(block);
+						if (onBoard(block)) {
+							destroyedBlocks.insert(block);
+						}
 					}
 					break;
 				case EventEnum::PlayerMoved:
 					outDrawMessage.playerPositions.map[event.playerID] = event.position;
+					outDrawMessage.playersMoved.map[event.playerID] = event.position;
+					if (event.playerID.value == ownPlayerID) {
+						ownPosition = event.position;
+					}
 					break;
 				case EventEnum::BlockPlaced:
-					outDrawMessage.blocks.set.insert(event.position);
+					if (blocks.insert(event.position)) {
+						outDrawMessage.blocksPlaced.set.insert(event.position);
+					}
+					break;
+				case EventEnum::BlockField:
+					blocks.insertField(
+					    event.blockField.list,
+					    [&](const DataPosition & block) {
+						    outDrawMessage.blocksPlaced.set.insert(block);
+					    }
+					);
+					break;
+				case EventEnum::ScoreChanged:
+					outDrawMessage.scores.map[event.playerID] = event.score;
+					outDrawMessage.scoresChanged.map[event.playerID] = event.score;
 					break;
 				default:
 					break;
 				}
 			}
 
-			/* Finally, copy new values to the list of bombs. */
-			outDrawMessage.bombs.list.clear();
-			for (auto & entry : activeBombs) {
-				outDrawMessage.bombs.list.push_back(entry.second);
-			}
-			/* Update scores and blocks */
+			/* Finally, update scores and blocks. */
 			for (uint8_t playerID : destroyedPlayers) {
-				outDrawMessage.scores.map[{playerID}].value++;
+				outDrawMessage.scoresChanged.map[{playerID}] =
+				    {++outDrawMessage.scores.map[{playerID}].value};
 			}
 			for (const DataPosition & block : destroyedBlocks) {
-				outDrawMessage.blocks.set.erase(block);
+				/* A block placed and destroyed since the last frame is no change. */
+				if (blocks.erase(block) &&
+				    !outDrawMessage.blocksPlaced.set.erase(block)) {
+					outDrawMessage.blocksDestroyed.set.insert(block);
+				}
 			}
 		}
 
 	public:
-		const DataDrawMessage &
-		processServerMessage(const DataServerMessage & inMessage) {
+		/*
+		 * Shows where the input takes this client's player, if known, as the
+		 * server would move it. Returns whether the frame changed and is to be
+		 * sent again.
+		 */
+		bool predictInput(const DataInputMessage & inMessage) {
+			if (!predictMoves || state != GameState::Game || !ownPlayerID ||
+			    !outDrawMessage.playerPositions.map.contains({*ownPlayerID})) {
+				return false;
+			}
+			DataPosition position = ownPosition;
+			if (inMessage.type == InputMessageEnum::Move) {
+				DataPosition target = PositionGrid::along(
+				    ownPosition, inMessage.direction.direction, 1
+				);
+				// Stepping off the board wraps around, out of its bounds.
+				if (onBoard(target) && !blocks.contains(target)) {
+					position = target;
+				}
+			}
+			DataPosition & shown =
+			    outDrawMessage.playerPositions.map[{*ownPlayerID}];
+			if (shown.x.value == position.x.value &&
+			    shown.y.value == position.y.value) {
+				return false;
+			}
+			shown = position;
+			outDrawMessage.playersMoved.map[{*ownPlayerID}] = position;
+			predicted = true;
+			return true;
+		}
+
+		/* Marks a frame of the current state as due. */
+		void queueFrame() {
+			unsentFrames++;
+			frameCV.notify_one();
+		}
+
+		/* Leaves out the frame of the current state, a later one replaces it. */
+		void skipFrame() {
+			framesSkipped = true;
+		}
+
+		/* Encodes the frame which is due, noting that it is sent. */
+		void takeFrame(MemoryBuffer & frame) {
+			prepareDrawMessage(unsentFrames > 1 || framesSkipped);
+			unsentFrames = 0;
+			framesSkipped = false;
+			frame.clear();
+			frame << outDrawMessage;
+			/* A datagram so large is dropped, so the next frame is a full one. */
+			if (!GUIOverTCP && frame.length() > DATAGRAM_SIZE_MAX) {
+				deltaFrames = keyframeInterval;
+			}
+		}
+
+		void sendFrame(const MemoryBuffer & frame) {
+			if (GUIOverTCP) {
+				boost::asio::write(GUIStream, buffer(frame.data(), frame.length()));
+			} else if (frame.length() <= DATAGRAM_SIZE_MAX) {
+				GUISocket.send_to(buffer(frame.data(), frame.length()), GUIEndpoint);
+			} else {
+				/* Only a datagram can be too large. Skip the frame. */
+				debug("Draw message too large for UDP, try --gui-transport tcp.\n");
+			}
+		}
+
+		void processServerMessage(const DataServerMessage & inMessage) {
 			destroyedPlayers.clear();
 			destroyedBlocks.clear();
 
@@ -227,6 +570,9 @@ namespace {
 				outDrawMessage.gameLength = inMessage.gameLength;
 				outDrawMessage.explosionRadius = inMessage.explosionRadius;
 				outDrawMessage.bombTimer = inMessage.bombTimer;
+				blocks.reset(outDrawMessage.sizeX.value, outDrawMessage.sizeY.value);
+				explosions.reset(outDrawMessage.sizeX.value, outDrawMessage.sizeY.value);
+				explosionCells.clear();
 				break;
 			case ServerMessageEnum::AcceptedPlayer:
 				outDrawMessage.players.map.insert({inMessage.playerID, inMessage.player}
@@ -236,9 +582,13 @@ namespace {
 			case ServerMessageEnum::GameStarted:
 				state = GameState::Game;
 				outDrawMessage.type = DrawMessageEnum::Game;
+				/* The GUI saw a lobby last, so the first turn gets a full frame. */
+				deltaFrames = keyframeInterval;
 				outDrawMessage.players = inMessage.players;
+				findOwnPlayer(inMessage);
+				predicted = false;
 				outDrawMessage.playerPositions.map.clear();
-				outDrawMessage.blocks.set.clear();
+				blocks.clear();
 				outDrawMessage.scores.map.clear();
 				for (auto & player : outDrawMessage.players.map) {
 					outDrawMessage.scores.map[player.first] = {0};
@@ -249,7 +599,9 @@ namespace {
 				break;
 			case ServerMessageEnum::GameEnded:
 				state = GameState::Lobby;
-				activeBombs.clear();
+				bombIndices.clear();
+				bombIDs.clear();
+				blocks.clear();
 				outDrawMessage.type = DrawMessageEnum::Lobby;
 				outDrawMessage.players.map.clear();
 				outDrawMessage.playerPositions.map.clear();
@@ -260,28 +612,42 @@ namespace {
 			default:
 				break;
 			}
-
-			return outDrawMessage;
 		}
 	};
 
 	void listenToGUI(Client & variables) {
 		try {
-			UDPBuffer GUIBufferIn(variables.GUISocket, variables.GUIEndpoint);
+			std::unique_ptr<Buffer> GUIBufferIn = variables.makeGUIBuffer();
 			TCPBuffer serverBufferOut(variables.serverSocket);
 			DataInputMessage inMessage;
 
 			while (true) {
+				/* A bad datagram can be skipped, a bad stream cannot. */
 				try {
-					GUIBufferIn >> inMessage;
+					*GUIBufferIn >> inMessage;
 				} catch (BadRead & e) {
+					if (variables.GUIOverTCP) {
+						throw;
+					}
 					continue;
 				} catch (BadType & e) {
+					if (variables.GUIOverTCP) {
+						throw;
+					}
 					continue;
 				}
 
-				std::lock_guard<std::mutex> lockGuard(variables.variablesMutex);
-				serverBufferOut << variables.processInputMessage(inMessage);
+				{
+					std::lock_guard<std::mutex> lockGuard(variables.variablesMutex);
+					variables.processInputMessage(inMessage);
+					variables.submitInput(serverBufferOut);
+				}
+				if (variables.predictMoves) {
+					std::lock_guard<std::mutex> drawGuard(variables.drawMutex);
+					if (variables.predictInput(inMessage)) {
+						variables.queueFrame();
+					}
+				}
 			}
 		} catch (std::exception & e) {
 			{
@@ -294,19 +660,81 @@ namespace {
 
 	void listenToServer(Client & variables) {
 		try {
-			TCPBuffer serverBufferIn(variables.serverSocket);
-			UDPBuffer GUIBufferOut(variables.GUISocket, variables.GUIEndpoint);
+			TCPBuffer serverBufferIn(
+			    variables.serverSocket, variables.receiveBufferSize
+			);
+			TCPBuffer serverBufferOut(variables.serverSocket);
 			DataServerMessage inMessage;
 
 			while (true) {
 				serverBufferIn >> inMessage;
 
+				/* While catching up, only the state after the last message is drawn. */
+				bool behind = variables.catchUp &&
+				              (serverBufferIn.unread() > 0 ||
+				               variables.serverSocket.available() > 0);
+				{
+					std::lock_guard<std::mutex> drawGuard(variables.drawMutex);
+					variables.processServerMessage(inMessage);
+					if (behind) {
+						variables.skipFrame();
+					} else if (inMessage.type != ServerMessageEnum::GameStarted) {
+						variables.queueFrame();
+					}
+				}
 				std::lock_guard<std::mutex> lockGuard(variables.variablesMutex);
-				const DataDrawMessage & outMessage =
-				    variables.processServerMessage(inMessage);
-				if (inMessage.type != ServerMessageEnum::GameStarted) {
-					GUIBufferOut << outMessage;
+				variables.followServerMessage(inMessage, serverBufferOut);
+			}
+		} catch (std::exception & e) {
+			{
+				std::lock_guard<std::mutex> guard(exceptionMutex);
+				exceptionPtr = std::current_exception();
+			}
+			exceptionCV.notify_one();
+		}
+	}
+	/* Sends the GUI the latest frame whenever one is due. */
+	void sendFrames(Client & variables) {
+		try {
+			MemoryBuffer frame;
+			std::unique_lock<std::mutex> lock(variables.drawMutex);
+			while (true) {
+				variables.frameCV.wait(lock, [&]() {
+					return variables.stopping || variables.unsentFrames > 0;
+				});
+				if (variables.stopping) {
+					return;
+				}
+				variables.takeFrame(frame);
+				lock.unlock();
+				variables.sendFrame(frame);
+				lock.lock();
+			}
+		} catch (std::exception & e) {
+			{
+				std::lock_guard<std::mutex> guard(exceptionMutex);
+				exceptionPtr = std::current_exception();
+			}
+			exceptionCV.notify_one();
+		}
+	}
+
+	/* Sends coalesced inputs which had to wait for their interval to pass. */
+	void flushInputs(Client & variables) {
+		try {
+			TCPBuffer serverBufferOut(variables.serverSocket);
+			std::unique_lock<std::mutex> lock(variables.variablesMutex);
+			while (!variables.stopping) {
+				if (!variables.inputPending) {
+					variables.inputCV.wait(lock);
+					continue;
 				}
+				auto due = variables.lastInputSent + variables.inputInterval;
+				if (std::chrono::steady_clock::now() < due) {
+					variables.inputCV.wait_until(lock, due);
+					continue;
+				}
+				variables.sendInput(serverBufferOut);
 			}
 		} catch (std::exception & e) {
 			{
@@ -352,12 +780,20 @@ int main(int argc, char ** argv) {
 	/* Main loops. */
 	std::shared_ptr<std::thread> GUIListener;
 	std::shared_ptr<std::thread> serverListener;
+	std::shared_ptr<std::thread> frameSender;
+	std::shared_ptr<std::thread> inputFlusher;
 
 	try {
 		GUIListener =
 		    std::make_shared<std::thread>(listenToGUI, std::ref(*variables));
 		serverListener =
 		    std::make_shared<std::thread>(listenToServer, std::ref(*variables));
+		frameSender =
+		    std::make_shared<std::thread>(sendFrames, std::ref(*variables));
+		if (variables->inputCoalescing == Client::InputCoalescing::Interval) {
+			inputFlusher =
+			    std::make_shared<std::thread>(flushInputs, std::ref(*variables));
+		}
 
 		/* Listen for exceptions. */
 		std::unique_lock<std::mutex> guard(exceptionMutex);
@@ -381,10 +817,26 @@ int main(int argc, char ** argv) {
 		} catch (std::exception & f) {
 			// OK
 		}
+		try {
+			variables->GUIStream.shutdown(tcp::socket::shutdown_both);
+		} catch (std::exception & f) {
+			// OK
+		}
 		variables->GUISocket.close();
+		variables->GUIStream.close();
 		variables->serverSocket.close();
+		{
+			std::scoped_lock lock(variables->variablesMutex, variables->drawMutex);
+			variables->stopping = true;
+		}
+		variables->inputCV.notify_all();
+		variables->frameCV.notify_all();
 		GUIListener->join();
 		serverListener->join();
+		frameSender->join();
+		if (inputFlusher) {
+			inputFlusher->join();
+		}
 		debug(std::string(e.what()));
 		return 1;
 	}
@@ -0,0 +1,496 @@
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer.h"
+#include "exceptions.h"
+#include "messages.h"
+#include "options.h"
+#include "utils.h"
+
+using namespace boost::asio;
+using namespace boost::asio::ip;
+using namespace boost::program_options;
+
+/*
+ * Load generator: opens many connections to a server from one process, joins
+ * some of them as players, which make a move every turn, and keeps the others
+ * as observers. When every connection is done, or on SIGINT, it reports how
+ * late turns arrived.
+ */
+
+namespace {
+	using LoadClock = std::chrono::steady_clock;
+
+	class TurnArrival {
+	public:
+		// Index into the connection's games.
+		size_t game;
+		uint16_t turn;
+		LoadClock::time_point time;
+	};
+
+	/*
+	 * Like the server's connections, all operations on a connection run on its
+	 * strand. Messages are parsed from a MemoryBuffer as they come, since
+	 * TCPBuffer blocks on reads.
+	 */
+	class LoadConnection : public std::enable_shared_from_this<LoadConnection> {
+	public:
+		static const size_t RECEIVE_SIZE = 1 << 16;
+
+		size_t index;
+		bool player;
+		tcp::socket socket;
+		MemoryBuffer inBuffer;
+		DataServerMessage inMessage;
+		// One buffer is being written while the other collects messages.
+		MemoryBuffer outBuffers[2];
+		size_t writingBuffer = 0;
+		bool sending = false;
+		bool finished = false;
+
+		DataString name;
+		Random random;
+		size_t scriptPosition;
+		// Whether the player is in the current game.
+		bool playing = false;
+		uint16_t gamesEnded = 0;
+
+		// Identifies each game seen by its players and its ordinal, to compare
+		// connections.
+		std::vector<std::string> games;
+		std::vector<TurnArrival> arrivals;
+		std::string error;
+
+		LoadConnection(
+		    io_context & context, size_t newIndex, bool newPlayer,
+		    const std::string & playerName, uint64_t seed
+		) :
+		    index(newIndex), player(newPlayer), socket(make_strand(context)),
+		    name({playerName + std::to_string(newIndex)}), random(seed + newIndex),
+		    scriptPosition(newIndex) {
+		}
+	};
+
+	// Nearest-rank percentile of sorted samples.
+	int64_t percentile(const std::vector<int64_t> & sorted, double fraction) {
+		if (sorted.empty()) {
+			return 0;
+		}
+		auto rank = size_t(fraction * double(sorted.size()));
+		return sorted[std::min(rank, sorted.size() - 1)];
+	}
+
+	std::string describe(std::vector<int64_t> & samples) {
+		std::sort(samples.begin(), samples.end());
+		std::stringstream ss;
+		ss << "p50 " << percentile(samples, 0.5) << " p90 "
+		   << percentile(samples, 0.9) << " p99 " << percentile(samples, 0.99)
+		   << " p99.9 " << percentile(samples, 0.999) << " max "
+		   << (samples.empty() ? 0 : samples.back());
+		return ss.str();
+	}
+
+	class LoadGenerator {
+	public:
+		io_context context;
+		variables_map options;
+		tcp::resolver resolver;
+		tcp::endpoint serverEndpoint;
+		signal_set signals;
+
+		LoadClock::duration turnDuration;
+		uint16_t games;
+		std::string script;
+		uint16_t threadCount;
+		std::vector<std::shared_ptr<LoadConnection>> connections;
+		std::atomic<size_t> connectionsLeft;
+
+		LoadGenerator(int argc, char ** argv) :
+		    options(handleOptions(argc, argv, getLoadOptionsDescription())),
+		    resolver(context),
+		    serverEndpoint(resolveAddress<tcp::endpoint, tcp::resolver>(
+		        resolver, options["server-address"].as<std::string>(),
+		        std::string(argv[0])
+		    )),
+		    signals(context, SIGINT),
+		    turnDuration(
+		        std::chrono::milliseconds(options["turn-duration"].as<uint64_t>())
+		    ),
+		    games(options["games"].as<uint16_t>()),
+		    script(options["script"].as<std::string>()),
+		    threadCount(options["threads"].as<uint16_t>()) {
+			auto connectionCount = options["connections"].as<uint16_t>();
+			auto playerCount = options["players"].as<uint16_t>();
+			if (playerCount > connectionCount) {
+				throw RobotsException(
+				    "Error: the argument ('" + std::to_string(playerCount) +
+				    "') for option '--players' is invalid, there are only " +
+				    std::to_string(connectionCount) + " connections.\nRun " +
+				    std::string(argv[0]) + " --help for usage.\n"
+				);
+			}
+			if (script.find_first_not_of("bkurdl") != std::string::npos) {
+				throw RobotsException(
+				    "Error: the argument ('" + script +
+				    "') for option '--script' is invalid.\nRun " +
+				    std::string(argv[0]) + " --help for usage.\n"
+				);
+			}
+			if (threadCount == 0) {
+				throw RobotsException(
+				    "Error: the argument ('0') for option '--threads' is "
+				    "invalid.\nRun " +
+				    std::string(argv[0]) + " --help for usage.\n"
+				);
+			}
+
+			for (size_t i = 0; i < connectionCount; i++) {
+				connections.push_back(std::make_shared<LoadConnection>(
+				    context, i, i < playerCount,
+				    options["player-name"].as<std::string>(),
+				    options["seed"].as<uint32_t>()
+				));
+			}
+			connectionsLeft = connectionCount;
+		}
+
+		void run() {
+			signals.async_wait([this](const boost::system::error_code & error, int) {
+				if (!error) {
+					for (auto & connection : connections) {
+						post(connection->socket.get_executor(), [this, connection]() {
+							finish(connection, "interrupted");
+						});
+					}
+				}
+			});
+			for (auto & connection : connections) {
+				connect(connection);
+			}
+
+			std::vector<std::thread> threads;
+			for (uint16_t i = 0; i < threadCount; i++) {
+				threads.emplace_back([this]() {
+					context.run();
+				});
+			}
+			for (std::thread & thread : threads) {
+				thread.join();
+			}
+		}
+
+		void connect(const std::shared_ptr<LoadConnection> & connection) {
+			connection->socket.async_connect(
+			    serverEndpoint,
+			    [this, connection](const boost::system::error_code & error) {
+				    if (error) {
+					    finish(connection, error.message());
+					    return;
+				    }
+				    boost::system::error_code optionError;
+				    connection->socket.set_option(tcp::no_delay(true), optionError);
+				    listen(connection);
+			    }
+			);
+		}
+
+		// Closes the connection, the first reason given is kept.
+		void finish(
+		    const std::shared_ptr<LoadConnection> & connection,
+		    const std::string & reason
+		) {
+			if (connection->finished) {
+				return;
+			}
+			connection->finished = true;
+			connection->error = reason;
+			boost::system::error_code error;
+			connection->socket.shutdown(tcp::socket::shutdown_both, error);
+			connection->socket.close(error);
+			if (--connectionsLeft == 0) {
+				signals.cancel();
+			}
+		}
+
+		void listen(const std::shared_ptr<LoadConnection> & connection) {
+			connection->socket.async_read_some(
+			    buffer(
+			        connection->inBuffer.prepare(LoadConnection::RECEIVE_SIZE),
+			        LoadConnection::RECEIVE_SIZE
+			    ),
+			    [this,
+			     connection](const boost::system::error_code & error, size_t bytes) {
+				    if (error) {
+					    finish(connection, error.message());
+					    return;
+				    }
+				    LoadClock::time_point now = LoadClock::now();
+				    connection->inBuffer.commit(bytes);
+
+				    // Parse all complete messages, leave the incomplete one for later.
+				    try {
+					    while (connection->inBuffer.length() > 0 &&
+					           !connection->finished) {
+						    size_t messageStart = connection->inBuffer.position();
+						    try {
+							    connection->inBuffer >> connection->inMessage;
+						    } catch (BadRead & e) {
+							    connection->inBuffer.rewind(messageStart);
+							    break;
+						    }
+						    handleMessage(connection, now);
+					    }
+				    } catch (std::exception & e) {
+					    finish(connection, e.what());
+					    return;
+				    }
+
+				    if (!connection->finished) {
+					    listen(connection);
+				    }
+			    }
+			);
+		}
+
+		void handleMessage(
+		    const std::shared_ptr<LoadConnection> & connection,
+		    LoadClock::time_point now
+		) {
+			const DataServerMessage & message = connection->inMessage;
+			switch (message.type) {
+			case ServerMessageEnum::Hello:
+				if (connection->player) {
+					join(connection);
+				}
+				break;
+			case ServerMessageEnum::GameStarted: {
+				std::string key;
+				connection->playing = false;
+				for (const auto & [playerID, player] : message.players.map) {
+					key += std::to_string(playerID.value) + ":" + player.name.value +
+					       "@" + player.address.value + ";";
+					connection->playing |= connection->player &&
+					                       player.name.value == connection->name.value;
+				}
+				// The same players may play again, all connections see their games
+				// in the same order, having connected at the same time.
+				key += std::to_string(std::count_if(
+				    connection->games.begin(), connection->games.end(),
+				    [&](const std::string & game) {
+					    return game.starts_with(key);
+				    }
+				));
+				connection->games.push_back(std::move(key));
+				break;
+			}
+			case ServerMessageEnum::Turn:
+				if (connection->games.empty()) {
+					break;
+				}
+				connection->arrivals.push_back(
+				    {connection->games.size() - 1, message.turn.value, now}
+				);
+				if (connection->playing) {
+					move(connection);
+				}
+				break;
+			case ServerMessageEnum::GameEnded:
+				connection->playing = false;
+				connection->gamesEnded++;
+				if (games > 0 && connection->gamesEnded >= games) {
+					finish(connection, "");
+				} else if (connection->player) {
+					join(connection);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+
+		void join(const std::shared_ptr<LoadConnection> & connection) {
+			DataClientMessage message;
+			message.type = ClientMessageEnum::Join;
+			message.name = connection->name;
+			send(connection, message);
+		}
+
+		// Makes the next move of the script, or a random one.
+		void move(const std::shared_ptr<LoadConnection> & connection) {
+			static const std::string MOVES = "bkurdl";
+			size_t position = connection->scriptPosition++;
+			char moveChar = script.empty()
+			                    ? MOVES[connection->random.next() % MOVES.size()]
+			                    : script[position % script.size()];
+			DataClientMessage message;
+			switch (moveChar) {
+			case 'b':
+				message.type = ClientMessageEnum::PlaceBomb;
+				break;
+			case 'k':
+				message.type = ClientMessageEnum::PlaceBlock;
+				break;
+			default:
+				message.type = ClientMessageEnum::Move;
+				message.direction.direction = DirectionEnum(MOVES.find(moveChar) - 2);
+				break;
+			}
+			send(connection, message);
+		}
+
+		void send(
+		    const std::shared_ptr<LoadConnection> & connection,
+		    const DataClientMessage & message
+		) {
+			size_t collecting = connection->sending ? 1 - connection->writingBuffer
+			                                        : connection->writingBuffer;
+			connection->outBuffers[collecting] << message;
+			if (!connection->sending) {
+				write(connection);
+			}
+		}
+
+		void write(const std::shared_ptr<LoadConnection> & connection) {
+			MemoryBuffer & out = connection->outBuffers[connection->writingBuffer];
+			connection->sending = true;
+			async_write(
+			    connection->socket, buffer(out.data(), out.length()),
+			    [this, connection](const boost::system::error_code & error, size_t) {
+				    connection->sending = false;
+				    connection->outBuffers[connection->writingBuffer].clear();
+				    if (error) {
+					    finish(connection, error.message());
+					    return;
+				    }
+				    connection->writingBuffer = 1 - connection->writingBuffer;
+				    MemoryBuffer & collected =
+				        connection->outBuffers[connection->writingBuffer];
+				    if (collected.length() > 0) {
+					    write(connection);
+				    }
+			    }
+			);
+		}
+
+		/*
+		 * Turns are due on a fixed schedule, so a turn's latency is how much
+		 * later than on schedule it arrived, the schedule of each game being set
+		 * by the connection's earliest turn. Lag is how much later a connection
+		 * got a turn than the first connection in the same game.
+		 */
+		void report() {
+			auto toMicroseconds = [](LoadClock::duration duration) {
+				return int64_t(
+				    std::chrono::duration_cast<std::chrono::microseconds>(duration)
+				        .count()
+				);
+			};
+
+			std::unordered_map<std::string, std::vector<LoadClock::time_point>>
+			    firstArrivals;
+			for (const auto & connection : connections) {
+				for (const TurnArrival & arrival : connection->arrivals) {
+					auto & gameArrivals = firstArrivals[connection->games[arrival.game]];
+					if (gameArrivals.size() <= arrival.turn) {
+						gameArrivals.resize(
+						    size_t(arrival.turn) + 1, LoadClock::time_point::max()
+						);
+					}
+					gameArrivals[arrival.turn] =
+					    std::min(gameArrivals[arrival.turn], arrival.time);
+				}
+			}
+
+			std::vector<int64_t> allLatencies, allLags, connectionLatencies;
+			size_t players = 0, failed = 0;
+			std::stringstream perConnection;
+			for (const auto & connection : connections) {
+				players += connection->player;
+				failed += !connection->error.empty() &&
+				          connection->error != "interrupted";
+
+				std::vector<LoadClock::duration> offsets(
+				    connection->games.size(), LoadClock::duration::max()
+				);
+				for (const TurnArrival & arrival : connection->arrivals) {
+					offsets[arrival.game] = std::min(
+					    offsets[arrival.game],
+					    arrival.time.time_since_epoch() - arrival.turn * turnDuration
+					);
+				}
+				std::vector<int64_t> latencies, lags;
+				for (const TurnArrival & arrival : connection->arrivals) {
+					LoadClock::duration offset = offsets[arrival.game];
+					latencies.push_back(toMicroseconds(
+					    arrival.time.time_since_epoch() - arrival.turn * turnDuration -
+					    offset
+					));
+					lags.push_back(toMicroseconds(
+					    arrival.time -
+					    firstArrivals[connection->games[arrival.game]][arrival.turn]
+					));
+				}
+				allLatencies.insert(
+				    allLatencies.end(), latencies.begin(), latencies.end()
+				);
+				allLags.insert(allLags.end(), lags.begin(), lags.end());
+
+				std::sort(latencies.begin(), latencies.end());
+				if (!latencies.empty()) {
+					connectionLatencies.push_back(percentile(latencies, 0.99));
+				}
+				if (options.contains("per-connection")) {
+					perConnection << "  " << connection->index
+					              << (connection->player ? " player, " : " observer, ")
+					              << connection->arrivals.size() << " turns, latency "
+					              << describe(latencies) << ", lag " << describe(lags);
+					if (!connection->error.empty()) {
+						perConnection << " (" << connection->error << ")";
+					}
+					perConnection << "\n";
+				}
+			}
+
+			std::cout << connections.size() << " connections (" << players
+			          << " players), " << failed << " failed, " << allLatencies.size()
+			          << " turns received.\n"
+			          << "Turn latency (us): " << describe(allLatencies) << "\n"
+			          << "Server-to-client lag (us): " << describe(allLags) << "\n"
+			          << "Connections' p99 latency (us): "
+			          << describe(connectionLatencies) << "\n";
+			if (options.contains("per-connection")) {
+				std::cout << "Per connection (us):\n" << perConnection.str();
+			}
+		}
+	};
+} // namespace
+
+int main(int argc, char ** argv) {
+	std::shared_ptr<LoadGenerator> generator;
+	try {
+		generator = std::make_shared<LoadGenerator>(argc, argv);
+	} catch (NeedHelp & e) {
+		/* Exception reserved for --help option. */
+		std::cout << getLoadOptionsDescription();
+		return 0;
+	} catch (RobotsException & e) {
+		std::cerr << e.what();
+		return 1;
+	} catch (std::exception & e) {
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+
+	generator->run();
+	generator->report();
+}
@@ -1,8 +1,12 @@
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
+#include <atomic>
 #include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <thread>
 #include <unordered_map>
@@ -10,9 +14,15 @@
 #include <vector>
 
 #include "buffer.h"
+#include "game.h"
+#include "scheduler.h"
 #include "messages.h"
+#include "metrics.h"
 #include "options.h"
+#include "replay.h"
+#include "trace.h"
 #include "utils.h"
+#include "workers.h"
 
 using namespace boost::asio;
 using namespace boost::asio::ip;
@@ -24,6 +34,9 @@ namespace {
 	std::mutex exceptionMutex;
 	std::condition_variable exceptionCV;
 
+	// Set after SIGUSR1, guarded by exceptionMutex as well.
+	bool traceRequested = false;
+
 	void handleInterrupt([[maybe_unused]] int signal) {
 		try {
 			throw InterruptedException();
@@ -36,98 +49,385 @@ namespace {
 		}
 	}
 
-	class ServerMessageQueue {
+	/*
+	 * Memory of one game's messages. It is only ever allocated from by the game
+	 * loop and it is released as a whole, once the last message allocated from
+	 * it is destroyed, possibly long after the game is cleared.
+	 */
+	using GameArena = std::pmr::monotonic_buffer_resource;
+
+	/*
+	 * Allocator drawing from a shared GameArena, which it keeps alive. Without an
+	 * arena, it falls back to the global heap.
+	 */
+	template <typename T> class ArenaAllocator {
 	public:
-		DataServerMessage message;
+		using value_type = T;
+
+		std::shared_ptr<GameArena> arena;
+
+		ArenaAllocator() = default;
+
+		explicit ArenaAllocator(std::shared_ptr<GameArena> newArena) :
+		    arena(std::move(newArena)) {
+		}
+
+		template <typename U>
+		explicit ArenaAllocator(const ArenaAllocator<U> & other) :
+		    arena(other.arena) {
+		}
+
+		T * allocate(size_t n) {
+			if (!arena) {
+				return std::allocator<T>().allocate(n);
+			}
+			return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+		}
+
+		void deallocate(T * pointer, size_t n) {
+			// Arena memory is only released together with the arena.
+			if (!arena) {
+				std::allocator<T>().deallocate(pointer, n);
+			}
+		}
+
+		template <typename U>
+		bool operator==(const ArenaAllocator<U> & other) const {
+			return arena == other.arena;
+		}
+	};
+
+	/*
+	 * Messages are encoded once, when they are put in the queue. The same
+	 * immutable bytes are then written to every connection.
+	 * Each node is linked to the next one at most once, by a single writer, and
+	 * the `linked` flag then publishes it, so that readers never need a lock.
+	 */
+	class ServerMessageQueue {
+	private:
 		std::shared_ptr<ServerMessageQueue> next;
+		std::atomic<bool> linked = false;
+
+	public:
+		std::vector<char, ArenaAllocator<char>> bytes;
+		// The message as a Compressed one, for clients which asked for that.
+		// Empty if it is not worth compressing.
+		std::vector<char, ArenaAllocator<char>> compressed;
+		// Position in the queue, used to tell how far behind a client is.
+		uint64_t sequence = 0;
+
+		ServerMessageQueue() = default;
+
+		// Copies the message, but not its place in the queue.
+		ServerMessageQueue(const ServerMessageQueue & other) :
+		    bytes(other.bytes), compressed(other.compressed),
+		    sequence(other.sequence) {
+		}
+
+		ServerMessageQueue & operator=(const ServerMessageQueue & other) {
+			bytes = other.bytes;
+			compressed = other.compressed;
+			sequence = other.sequence;
+			return *this;
+		}
+
+		explicit ServerMessageQueue(const DataServerMessage & message) {
+			MemoryBuffer encoded;
+			encoded << message;
+			bytes.assign(encoded.data(), encoded.data() + encoded.length());
+		}
+
+		ServerMessageQueue(
+		    const MemoryBuffer & encoded, const ArenaAllocator<char> & allocator
+		) :
+		    bytes(encoded.data(), encoded.data() + encoded.length(), allocator),
+		    compressed(allocator) {
+		}
+
+		ServerMessageQueue(
+		    std::span<const char> encoded, const ArenaAllocator<char> & allocator
+		) :
+		    bytes(encoded.begin(), encoded.end(), allocator), compressed(allocator) {
+		}
+
+		// Compresses the message once, for all connections which want that.
+		void compress(std::vector<char> & scratch) {
+			compressMessage(std::span<const char>(bytes), scratch);
+			compressed.assign(scratch.begin(), scratch.end());
+		}
+
+		void link(std::shared_ptr<ServerMessageQueue> node) {
+			next = std::move(node);
+			linked.store(true, std::memory_order_release);
+		}
+
+		// Returns the next node, or nullptr if it was not linked yet.
+		[[nodiscard]] std::shared_ptr<ServerMessageQueue> getNext() const {
+			if (!linked.load(std::memory_order_acquire)) {
+				return nullptr;
+			}
+			return next;
+		}
+	};
+
+	/*
+	 * Lock-free queue with many producers and a single consumer. Producers push
+	 * onto a stack, the consumer takes the whole stack at once and reverses it,
+	 * so that it sees values in the order they were pushed.
+	 */
+	template <typename T> class Inbox {
+	private:
+		class Node {
+		public:
+			T value;
+			Node * next;
+		};
+
+		std::atomic<Node *> top = nullptr;
+
+	public:
+		// Returns whether the inbox was empty, so that the consumer needs waking.
+		bool push(T value) {
+			Node * node = new Node{std::move(value), top.load(std::memory_order_relaxed)};
+			while (!top.compare_exchange_weak(
+			    node->next, node, std::memory_order_release, std::memory_order_relaxed
+			)) {
+			}
+			return node->next == nullptr;
+		}
+
+		// Calls `f` with every value pushed since the last drain, in order.
+		template <typename F> void drain(const F & f) {
+			Node * node = top.exchange(nullptr, std::memory_order_acquire);
+			Node * reversed = nullptr;
+			while (node) {
+				Node * next = node->next;
+				node->next = reversed;
+				reversed = node;
+				node = next;
+			}
+			while (reversed) {
+				Node * next = reversed->next;
+				f(reversed->value);
+				delete reversed;
+				reversed = next;
+			}
+		}
+
+		~Inbox() {
+			drain([](const T &) {});
+		}
 	};
 
 	class ClientConnection;
-	class Server;
+	// The value of an option, or `fallback` for one which is not given.
+	template <typename T>
+	T optionOr(
+	    const variables_map & options, const std::string & name, T fallback
+	) {
+		return options.count(name) ? options[name].as<T>() : fallback;
+	}
 
-	void listenToClient(Server &, ClientConnection &);
-	void emitToClient(ClientConnection &);
+	// Whether the server was asked to replay recorded games instead of hosting.
+	bool replayRequested(int argc, char ** argv) {
+		for (int i = 1; i < argc; i++) {
+			std::string argument(argv[i]);
+			if (argument == "--replay" || argument.starts_with("--replay=")) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	class Room;
 
-	class ClientConnection {
+	void listenToClient(Room &, const std::shared_ptr<ClientConnection> &);
+	void emitToClient(Room &, const std::shared_ptr<ClientConnection> &);
+
+	/*
+	 * All operations on a connection's socket are asynchronous and run on the
+	 * connection's strand, so that the connection never needs its own thread.
+	 * The strand also protects the buffers and the `sending` flag.
+	 */
+	class ClientConnection :
+	    public std::enable_shared_from_this<ClientConnection> {
 	public:
-		// Threads handling the connection
-		std::thread clientListener;
-		std::thread clientEmitter;
-		bool disconnected = false;
+		static const size_t RECEIVE_SIZE = 512;
+		static constexpr std::chrono::milliseconds REQUEST_WAIT{250};
+
+		std::atomic<bool> disconnected = false;
+		// Only used by the game loop.
 		bool joined = false;
+		uint8_t playerID = 0;
+		// Where the room's registry keeps the connection, guarded by the room.
+		size_t registrySlot = SIZE_MAX;
 
 		// Connection structures
-		std::shared_ptr<tcp::socket> clientSocket;
-		std::shared_ptr<TCPBuffer> inBuffer;
-		std::shared_ptr<TCPBuffer> outBuffer;
-
-		// Message receival members
-		std::mutex inMessageMutex{};
-		DataClientMessage inMessage;
-		bool inMessagePending = false;
+		tcp::socket clientSocket;
+		std::string address;
+		MemoryBuffer inBuffer;
+		std::vector<const_buffer> outBuffers;
+		bool sending = false;
+
+		/* Compression
+		 * A client asks for compressed messages before sending anything else. On
+		 * a room which compresses, only Hello is sent until the client sends its
+		 * first message, or until it had enough time to, so that a game's history
+		 * is not sent out before the request arrives.
+		 */
+		bool compress = false;
+		bool awaitingRequest = false;
+		steady_timer requestTimer;
 
-		// Message broadcast members
+		// Message broadcast members, the mutex protects the head, which the game
+		// only touches when connecting the queue to new messages.
+		Room & room;
 		std::mutex forMessagesMutex{};
-		std::condition_variable forMessages{};
-		// Initialize with dummy message
+		// Initialize with dummy message. Only the head is kept, as holding on to
+		// any other node would keep all messages after it in memory.
 		std::shared_ptr<ServerMessageQueue> messageQueueHead =
 		    std::make_shared<ServerMessageQueue>();
-		std::shared_ptr<ServerMessageQueue> messageQueueTail = messageQueueHead;
 
-		explicit ClientConnection(Server & server) :
-		    clientListener(listenToClient, std::ref(server), std::ref(*this)) {
+		ClientConnection(Room & newRoom, tcp::socket && socket) :
+		    clientSocket(std::move(socket)),
+		    requestTimer(clientSocket.get_executor()), room(newRoom) {
+		}
+
+		// Holds back what follows Hello for at most `wait`, before any message is
+		// pushed or received.
+		void awaitRequest(std::chrono::steady_clock::duration wait) {
+			awaitingRequest = true;
+			requestTimer.expires_after(wait);
+			requestTimer.async_wait([connection = shared_from_this()](
+			                            const boost::system::error_code & error
+			                        ) {
+				if (!error) {
+					connection->stopAwaitingRequest();
+				}
+			});
+		}
+
+		// Lets the held back messages go. Must be called on the strand.
+		void stopAwaitingRequest() {
+			if (awaitingRequest) {
+				awaitingRequest = false;
+				requestTimer.cancel();
+				notify();
+			}
 		}
 
 		void pushMessage(std::shared_ptr<ServerMessageQueue> message) {
+			if (!message) {
+				return;
+			}
 			{
+				Tracer::clock::time_point lockStart = traceStart();
 				std::lock_guard<std::mutex> guard(forMessagesMutex);
-				while (messageQueueTail->next) {
-					messageQueueTail = messageQueueTail->next;
-				}
-				if (messageQueueTail != message) {
-					messageQueueTail->next = std::move(message);
+				traceSince("push lock", lockStart);
+				std::shared_ptr<ServerMessageQueue> tail = messageQueueHead;
+				while (std::shared_ptr<ServerMessageQueue> next = tail->getNext()) {
+					tail = std::move(next);
 				}
-				while (messageQueueTail->next) {
-					messageQueueTail = messageQueueTail->next;
+				if (tail != message) {
+					tail->link(std::move(message));
 				}
 			}
-			forMessages.notify_all();
+			notify();
 		}
 
+		// Schedules sending of whatever is waiting in the message queue.
 		void notify() {
-			forMessages.notify_all();
+			post(clientSocket.get_executor(), [connection = shared_from_this()]() {
+				emitToClient(connection->room, connection);
+			});
 		}
 
-		~ClientConnection() {
-			if (clientListener.joinable()) {
-				clientListener.join();
-			}
-			if (clientEmitter.joinable()) {
-				clientEmitter.join();
+		// Closes the socket. Must be called on the connection's strand.
+		void close() {
+			disconnected = true;
+			requestTimer.cancel();
+			boost::system::error_code error;
+			clientSocket.shutdown(tcp::socket::shutdown_both, error);
+			clientSocket.close(error);
+		}
+	};
+
+	/*
+	 * The connections of a room, packed at the front of a vector, so that going
+	 * through them visits live connections only. Each connection remembers its
+	 * slot, so that it is added and removed in constant time, the last one
+	 * moving into the slot of a removed one. Guarded by the room's mutex.
+	 */
+	class ConnectionRegistry {
+	private:
+		std::vector<std::shared_ptr<ClientConnection>> connections;
+
+	public:
+		void add(const std::shared_ptr<ClientConnection> & connection) {
+			connection->registrySlot = connections.size();
+			connections.push_back(connection);
+		}
+
+		/* Removes the connection, if it is still registered. */
+		void remove(ClientConnection & connection) {
+			size_t slot = connection.registrySlot;
+			if (slot >= connections.size() ||
+			    connections[slot].get() != &connection) {
+				return;
 			}
+			connections[slot] = std::move(connections.back());
+			connections[slot]->registrySlot = slot;
+			connections.pop_back();
+			connection.registrySlot = SIZE_MAX;
+		}
+
+		[[nodiscard]] size_t size() const {
+			return connections.size();
+		}
+
+		[[nodiscard]] bool empty() const {
+			return connections.empty();
+		}
+
+		[[nodiscard]] auto begin() const {
+			return connections.begin();
+		}
+
+		[[nodiscard]] auto end() const {
+			return connections.end();
 		}
 	};
 
 	class PlayerInfo {
 	public:
-		size_t connectionID;
-		DataPosition position;
+		std::shared_ptr<ClientConnection> connection;
 		DataString name;
 		DataString address;
 	};
 
-	class Server {
+	class InboxMessage {
 	public:
-		io_context context;
+		std::shared_ptr<ClientConnection> connection;
+		DataClientMessage message;
+	};
 
-		variables_map options;
+	const uint16_t PLAYER_COUNT_MAX = (1 << 8) - 1; // 255
+
+	/*
+	 * One game instance, with its own connections, simulation and message
+	 * queue. A room never blocks: its game is a chain of handlers on the room's
+	 * strand, woken up by messages in the lobby and by a timer during the game,
+	 * so that many rooms can share a few worker threads.
+	 */
+	class Room {
+	public:
+		size_t index;
 
 		// Protection from connecting at an unfortunate time.
-		std::mutex serverMutex{};
+		std::mutex roomMutex{};
 
 		// Server options and auxiliary variables.
 		std::string serverName;
-		static const uint16_t PLAYER_COUNT_MAX = (1 << 8) - 1; // 255
 		uint16_t playerCount;
 		uint16_t sizeX, sizeY;
 		uint16_t gameLength;
@@ -135,34 +435,41 @@ namespace {
 		uint16_t bombTimer;
 		uint64_t turnDuration;
 		uint16_t initialBlocks;
-		GameState state = GameState::Lobby;
-
-		// Connection-related members
-		tcp::endpoint serverEndpoint;
-		tcp::acceptor clientAcceptor;
-
-		size_t nextConnectionID = 0;
-		std::map<size_t, ClientConnection> clients;
-
-		std::mutex forMessagesMutex;
-		std::condition_variable forMessages;
-		int pendingMessages = 0;
-		bool isShutdown = false;
-
-		// Game simulation members
-		Random random;
-		std::set<DataPosition> blocks;
-		// sorted by explosion turn number, position, ID
-		std::priority_queue<
-		    std::pair<DataBomb, DataU32>, std::vector<std::pair<DataBomb, DataU32>>,
-		    std::greater<>>
-		    bombs;
-		uint32_t nextBombID = 0;
+		uint16_t snapshotInterval;
+		uint32_t maxBacklog;
+		// Messages this long or longer are compressed, 0 if none are.
+		uint32_t compressionThreshold;
+		TurnScheduler scheduler;
+		RoomMetrics metrics;
+		std::atomic<GameState> state = GameState::Lobby;
+		uint16_t currentTurn = 0;
+
+		// Game loop members
+		strand<io_context::executor_type> gameStrand;
+		steady_timer turnTimer;
+
+		// Connections are removed as soon as they are closed.
+		ConnectionRegistry clients;
+
+		// Messages from all clients, drained by the game loop.
+		Inbox<InboxMessage> inbox;
+
+		// The simulation, player IDs index both its players and joinedPlayers.
+		Game game;
 		std::vector<PlayerInfo> joinedPlayers;
-		DataMap<DataU8, DataU32> playerScores;
-		std::map<DataPosition, std::set<DataU8>> playersByPosition;
-		std::set<DataPosition> blocksDestroyed;
-		std::set<DataU8> playersDestroyed;
+
+		/* Per-game memory
+		 * Queue nodes of a game are allocated from its arena, encoded through one
+		 * reused buffer. The turn message is reused between turns as well, and the
+		 * game recycles its events, so that the turn loop does not allocate once it
+		 * warms up.
+		 */
+		static const size_t GAME_ARENA_CHUNK = 1 << 16;
+		std::shared_ptr<GameArena> arena =
+		    std::make_shared<GameArena>(GAME_ARENA_CHUNK);
+		MemoryBuffer encodeBuffer;
+		std::vector<char> compressBuffer;
+		DataServerMessage currentTurnMessage;
 
 		/* Message storage
 		 * Hello message is copied for each connection.
@@ -176,76 +483,284 @@ namespace {
 		 * When the last player joins, a GameStarted message is prepared immediately
 		 * to avoid shenanigans with new connections not having a message ready and
 		 * having to be notified when they can send something.
+		 * Every snapshotInterval turns, the game messages so far are replaced, for
+		 * new connections, by a snapshot: an equivalent but short queue, which
+		 * joins the main queue at the next turn. Messages nobody needs any more are
+		 * then freed, and clients lagging more than maxBacklog messages behind are
+		 * disconnected, so that they cannot hold on to them forever.
 		 */
-		DataServerMessage helloMessage;
+		ServerMessageQueue helloNode;
 		std::shared_ptr<ServerMessageQueue> acceptedPlayerMessagesHead = nullptr;
 		std::shared_ptr<ServerMessageQueue> currentGameMessagesHead = nullptr;
 		std::shared_ptr<ServerMessageQueue> messageQueueTail = nullptr;
-
-		Server(int argc, char ** argv) :
-		    context(),
-		    options(handleOptions(argc, argv, getServerOptionsDescription())),
-		    serverName(options["server-name"].as<std::string>()),
-		    playerCount(options["players-count"].as<uint16_t>()),
-		    sizeX(options["size-x"].as<uint16_t>()),
-		    sizeY(options["size-y"].as<uint16_t>()),
-		    gameLength(options["game-length"].as<uint16_t>()),
-		    explosionRadius(options["explosion-radius"].as<uint16_t>()),
-		    bombTimer(options["bomb-timer"].as<uint16_t>()),
-		    turnDuration(options["turn-duration"].as<uint64_t>()),
-		    initialBlocks(options["initial-blocks"].as<uint16_t>()),
-		    serverEndpoint(tcp::v6(), options["port"].as<port_t>()),
-		    clientAcceptor(context, serverEndpoint),
-		    random(uint64_t(options["seed"].as<uint32_t>())) {
-			if (playerCount > PLAYER_COUNT_MAX) {
-				throw RobotsException(
-				    "Error: the argument ('" + std::to_string(playerCount) +
-				    "') for option '--players-count' is invalid.\n" + "Run " +
-				    std::string(argv[0]) + " --help for usage.\n"
+		std::shared_ptr<ServerMessageQueue> snapshotTail = nullptr;
+		std::atomic<uint64_t> lastSequence = 0;
+		DataServerMessage gameStartedMessage;
+
+		/* Recording and replaying
+		 * A recording room writes each game's messages, as queued, to its file.
+		 * A replaying room plays no games of its own, it queues the recorded
+		 * messages one turn at a time instead, while anyone is connected.
+		 */
+		std::unique_ptr<ReplayWriter> recorder;
+		std::shared_ptr<const ReplayFile> replay;
+		size_t replayGame = 0;
+		size_t replayMessage = 0;
+
+		/*
+		 * Rooms' turns are spread evenly over the turn duration, so that their
+		 * ticks do not all fall on the same moment.
+		 * A replaying room takes the game's settings from the recording.
+		 */
+		Room(
+		    const variables_map & options, io_context & gameContext,
+		    size_t newIndex, size_t roomCount,
+		    const std::shared_ptr<const ReplayFile> & newReplay
+		) :
+		    Room(
+		        options, gameContext, newIndex, roomCount, newReplay,
+		        makeHello(options, newReplay.get())
+		    ) {
+			std::string recordPath = optionOr<std::string>(options, "record", "");
+			if (!recordPath.empty()) {
+				if (roomCount > 1) {
+					recordPath += "." + std::to_string(index);
+				}
+				recorder = std::make_unique<ReplayWriter>(
+				    recordPath, std::span<const char>(helloNode.bytes), turnDuration
 				);
 			}
-			std::stringstream ss;
-			ss << "Listening for " << serverEndpoint << "\n";
-			debug(ss.str());
+		}
 
-			// Prepare hello message.
+		Room(
+		    const variables_map & options, io_context & gameContext,
+		    size_t newIndex, size_t roomCount,
+		    const std::shared_ptr<const ReplayFile> & newReplay,
+		    const DataServerMessage & hello
+		) :
+		    index(newIndex), serverName(hello.serverName.value),
+		    playerCount(hello.playerCount.value), sizeX(hello.sizeX.value),
+		    sizeY(hello.sizeY.value), gameLength(hello.gameLength.value),
+		    explosionRadius(hello.explosionRadius.value),
+		    bombTimer(hello.bombTimer.value),
+		    turnDuration(
+		        newReplay ? newReplay->turnDuration
+		                  : options["turn-duration"].as<uint64_t>()
+		    ),
+		    initialBlocks(optionOr<uint16_t>(options, "initial-blocks", 0)),
+		    snapshotInterval(optionOr<uint16_t>(options, "snapshot-interval", 0)),
+		    maxBacklog(options["max-backlog"].as<uint32_t>()),
+		    compressionThreshold(
+		        optionOr<uint32_t>(options, "compression-threshold", 0)
+		    ),
+		    scheduler(
+		        turnPeriod(options, turnDuration, newReplay != nullptr),
+		        // Spinning would hold up the other rooms' turns on a shared thread.
+		        roomCount > 1 ? std::chrono::microseconds::zero()
+		                      : std::chrono::microseconds(
+		                            options["spin-time"].as<uint64_t>()
+		                        ),
+		        roomCount > 1 ? std::optional<std::chrono::steady_clock::duration>(
+		                            std::chrono::milliseconds(turnDuration) *
+		                            int64_t(index) / int64_t(roomCount)
+		                        )
+		                      : std::nullopt
+		    ),
+		    gameStrand(make_strand(gameContext)), turnTimer(gameStrand),
+		    game(
+		        sizeX, sizeY, explosionRadius, bombTimer, initialBlocks, playerCount,
+		        uint64_t(optionOr<uint32_t>(options, "seed", 0)) + index
+		    ),
+		    replay(newReplay) {
+			helloNode = ServerMessageQueue(hello);
+			game.setBlockField(options.count("block-field") > 0);
+		}
+
+		// The Hello message of the recording, or one made of the options.
+		static DataServerMessage
+		makeHello(const variables_map & options, const ReplayFile * replayFile) {
+			DataServerMessage helloMessage;
+			if (replayFile) {
+				MemoryBuffer recorded;
+				memcpy(
+				    recorded.prepare(replayFile->hello.size()),
+				    replayFile->hello.data(), replayFile->hello.size()
+				);
+				recorded.commit(replayFile->hello.size());
+				recorded >> helloMessage;
+				return helloMessage;
+			}
 			helloMessage.type = ServerMessageEnum::Hello;
-			helloMessage.serverName = {serverName};
-			helloMessage.playerCount = {uint8_t(playerCount)};
-			helloMessage.sizeX = {sizeX};
-			helloMessage.sizeY = {sizeY};
-			helloMessage.gameLength = {gameLength};
-			helloMessage.explosionRadius = {explosionRadius};
-			helloMessage.bombTimer = {bombTimer};
+			helloMessage.serverName = {options["server-name"].as<std::string>()};
+			helloMessage.playerCount = {
+			    uint8_t(options["players-count"].as<uint16_t>())};
+			helloMessage.sizeX = {options["size-x"].as<uint16_t>()};
+			helloMessage.sizeY = {options["size-y"].as<uint16_t>()};
+			helloMessage.gameLength = {options["game-length"].as<uint16_t>()};
+			helloMessage.explosionRadius = {
+			    options["explosion-radius"].as<uint16_t>()};
+			helloMessage.bombTimer = {options["bomb-timer"].as<uint16_t>()};
+			return helloMessage;
+		}
+
+		// Replays are sped up, down to no waiting between turns at all.
+		static std::chrono::steady_clock::duration turnPeriod(
+		    const variables_map & options, uint64_t duration, bool replaying
+		) {
+			double speed = replaying ? options["replay-speed"].as<double>() : 1;
+			if (speed <= 0) {
+				return std::chrono::steady_clock::duration::zero();
+			}
+			return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			    std::chrono::duration<double, std::milli>(double(duration) / speed)
+			);
+		}
+
+		[[nodiscard]] size_t connectionCount() {
+			std::lock_guard<std::mutex> guard(roomMutex);
+			return clients.size();
+		}
+
+		void addConnection(const std::shared_ptr<ClientConnection> & connection) {
+			{
+				std::lock_guard<std::mutex> guard(roomMutex);
+				clients.add(connection);
+				if (compressionThreshold > 0) {
+					connection->awaitRequest(ClientConnection::REQUEST_WAIT);
+				}
+
+				/* Send Hello message (prepared in server) and make sure to append turn
+				 * message queue (GameStarted, Turn0, ...) if connected during game. */
+				// Copy helloNode.
+				std::shared_ptr<ServerMessageQueue> hello =
+				    std::make_shared<ServerMessageQueue>(helloNode);
+				hello->sequence = lastSequence;
+				connection->pushMessage(hello);
+				// If in game, push the current game messages, otherwise, list players.
+				if (state == GameState::Game) {
+					connection->pushMessage(currentGameMessagesHead);
+				} else {
+					connection->pushMessage(acceptedPlayerMessagesHead);
+				}
+			}
+
+			// A replay waits for someone to watch it.
+			if (replay && state == GameState::Lobby) {
+				post(gameStrand, [this]() {
+					collectPlayers();
+				});
+			}
+
+			// Now start the listening loop.
+			listenToClient(*this, connection);
+		}
+
+		// Every time a message is received, let the game know. In the lobby, the
+		// game waits for messages, so it is woken up.
+		void receiveMessage(
+		    const std::shared_ptr<ClientConnection> & connection,
+		    const DataClientMessage & inMessage
+		) {
+			if (inbox.push({connection, inMessage}) && state == GameState::Lobby) {
+				post(gameStrand, [this]() {
+					collectPlayers();
+				});
+			}
+		}
+
+		// Closes the connection after an error or a disconnect, on its strand, and
+		// stops sending it anything.
+		void disconnectClient(ClientConnection & connection) {
+			connection.close();
+			std::lock_guard<std::mutex> guard(roomMutex);
+			clients.remove(connection);
+		}
 
-			// Start first listener.
-			clients.emplace(std::make_pair(nextConnectionID++, std::ref(*this)));
+		// Keeps the message as the player's move for this turn, if from a player
+		// of the game being played. Players have no moves in the lobby.
+		void receiveInput(const InboxMessage & inMessage) {
+			const ClientConnection * connection = inMessage.connection.get();
+			if (state == GameState::Game && connection && connection->joined &&
+			    !connection->disconnected) {
+				game.setInput(connection->playerID, inMessage.message);
+			}
 		}
 
 		void notifyAllConnections() {
-			for (auto & i : clients) {
-				i.second.notify();
+			for (const auto & connection : clients) {
+				connection->notify();
 			}
 		}
 
 		void
 		pushToAllConnections(const std::shared_ptr<ServerMessageQueue> & message) {
-			for (auto & client : clients) {
-				client.second.pushMessage(message);
+			for (const auto & connection : clients) {
+				connection->pushMessage(message);
+			}
+		}
+
+		// Encodes the message into a queue node allocated from the game's arena.
+		std::shared_ptr<ServerMessageQueue>
+		makeNode(const DataServerMessage & message) {
+			encodeBuffer.clear();
+			encodeBuffer << message;
+			return compressed(std::allocate_shared<ServerMessageQueue>(
+			    ArenaAllocator<ServerMessageQueue>(arena), encodeBuffer,
+			    ArenaAllocator<char>(arena)
+			));
+		}
+
+		// Makes a node of the next recorded message of the game being replayed.
+		std::shared_ptr<ServerMessageQueue> makeReplayNode() {
+			return compressed(std::allocate_shared<ServerMessageQueue>(
+			    ArenaAllocator<ServerMessageQueue>(arena),
+			    replay->games[replayGame][replayMessage++],
+			    ArenaAllocator<char>(arena)
+			));
+		}
+
+		// Compresses a new node if it is long enough.
+		std::shared_ptr<ServerMessageQueue>
+		compressed(std::shared_ptr<ServerMessageQueue> node) {
+			if (compressionThreshold > 0 &&
+			    node->bytes.size() >= compressionThreshold) {
+				TraceScope scope("compress", node->bytes.size());
+				node->compress(compressBuffer);
+			}
+			return node;
+		}
+
+		void record(const std::shared_ptr<ServerMessageQueue> & node) {
+			if (recorder) {
+				recorder->write(std::span<const char>(node->bytes));
+			}
+		}
+
+		// Appends the node to the message queue, and to the snapshot if one waits.
+		void appendNode(const std::shared_ptr<ServerMessageQueue> & node) {
+			node->sequence = lastSequence + 1;
+			if (messageQueueTail) {
+				messageQueueTail->link(node);
+			}
+			if (snapshotTail) {
+				snapshotTail->link(node);
+				snapshotTail = nullptr;
 			}
+			messageQueueTail = node;
+			lastSequence = node->sequence;
+			RoomMetrics::add(metrics.bytesQueued, node->bytes.size());
 		}
 
 		void joinPlayer(
-		    const DataClientMessage & inMessage, const size_t connectionID,
-		    const std::string & address
+		    const DataClientMessage & inMessage,
+		    const std::shared_ptr<ClientConnection> & connection
 		) {
 			// Add player data to joinedPlayers vector.
 			auto playerID = uint8_t(joinedPlayers.size());
 			joinedPlayers.push_back({
-			    connectionID,   // connectionID
-			    {},             // position (currently undefined)
-			    inMessage.name, // name
-			    {address}       // address
+			    connection,           // connection
+			    inMessage.name,       // name
+			    {connection->address} // address
 			});
 
 			// Add AcceptedPlayer message to be sent to all connected clients.
@@ -255,80 +770,68 @@ namespace {
 			acceptedPlayerMessage.player = {
 			    joinedPlayers[playerID].name, joinedPlayers[playerID].address};
 
-			ServerMessageQueue acceptedPlayerNode{acceptedPlayerMessage, nullptr};
 			std::shared_ptr<ServerMessageQueue> nodePointer =
-			    std::make_shared<ServerMessageQueue>(acceptedPlayerNode);
+			    makeNode(acceptedPlayerMessage);
 
-			std::lock_guard<std::mutex> sGuard(serverMutex);
+			std::lock_guard<std::mutex> sGuard(roomMutex);
 			if (acceptedPlayerMessagesHead) {
 				// If a player was already accepted, add message to queue, notify.
-				messageQueueTail->next = nodePointer;
-				messageQueueTail = messageQueueTail->next;
+				appendNode(nodePointer);
 				notifyAllConnections();
 			} else {
 				// Else, start the queue and push it to all connections.
 				acceptedPlayerMessagesHead = nodePointer;
-				messageQueueTail = nodePointer;
+				appendNode(nodePointer);
 				pushToAllConnections(acceptedPlayerMessagesHead);
 			}
 		}
 
+		// Processes messages received in the lobby, starts the game once full.
 		void collectPlayers() {
-			auto connectionIterator = clients.begin();
-			while (joinedPlayers.size() < playerCount) {
-				{
-					// Wait until there will be a pending message
-					std::unique_lock<std::mutex> sGuard(forMessagesMutex);
-					forMessages.wait(sGuard, [&]() {
-						return pendingMessages > 0;
-					});
-				}
-
-				if (isShutdown) {
-					throw InterruptedException();
-				}
-
-				// Go back to the beginning if necessary
-				if (connectionIterator == clients.end()) {
-					connectionIterator = clients.begin();
-				}
-				auto currentIterator = connectionIterator;
-				connectionIterator++;
-
-				// Check iterator "validity". Remove client if invalid. Then, check if
-				// connection holds the message we are looking for. If so, process it.
-				ClientConnection & connection = currentIterator->second;
-				if (connection.disconnected) {
-					clients.erase(currentIterator);
-				} else if (connection.inMessagePending) {
-					// Found message, extract it.
-					DataClientMessage inMessage;
-					{
-						std::lock_guard<std::mutex> cGuard(connection.inMessageMutex);
-						std::lock_guard<std::mutex> sGuard(forMessagesMutex);
-						inMessage = connection.inMessage;
-						connection.inMessagePending = false;
-						pendingMessages--;
+			if (state != GameState::Lobby) {
+				return;
+			}
+			if (replay) {
+				collectViewers();
+				return;
+			}
+			{
+				inbox.drain([&](const InboxMessage & inMessage) {
+					const std::shared_ptr<ClientConnection> & connection =
+					    inMessage.connection;
+					if (!connection || connection->disconnected) {
+						return;
 					}
-
-					// Now, if it is a Join message, process it.
-					if (inMessage.type == ClientMessageEnum::Join && !connection.joined) {
-						connection.joined = true;
-						std::stringstream addressSS;
-						addressSS << connection.clientSocket->remote_endpoint();
-						joinPlayer(inMessage, currentIterator->first, addressSS.str());
+					// Only Join messages count in the lobby, moves are dropped, even
+					// those made after the last player joins.
+					if (inMessage.message.type == ClientMessageEnum::Join &&
+					    !connection->joined && joinedPlayers.size() < playerCount) {
+						connection->joined = true;
+						connection->playerID = uint8_t(joinedPlayers.size());
+						joinPlayer(inMessage.message, connection);
 					}
+				});
+			}
+
+			if (joinedPlayers.size() == playerCount) {
+				startGame();
+				// With a game length of 0, the game ends with turn 0.
+				if (gameLength > 0) {
+					scheduleTurn();
+				} else {
+					finishGame();
 				}
 			}
 		}
 
 		void startGame() {
 			// Acquire protection against new connections choosing message queues.
-			std::lock_guard<std::mutex> sGuard(serverMutex);
+			std::lock_guard<std::mutex> sGuard(roomMutex);
 			state = GameState::Game;
+			currentTurn = 0;
 
 			// Prepare GameStarted message
-			DataServerMessage gameStartedMessage;
+			gameStartedMessage.players.map.clear();
 			gameStartedMessage.type = ServerMessageEnum::GameStarted;
 			for (size_t i = 0; i < joinedPlayers.size(); i++) {
 				const PlayerInfo & joinedPlayer = joinedPlayers[i];
@@ -339,449 +842,864 @@ namespace {
 			}
 
 			// Push the GameStarted message
-			ServerMessageQueue gameStartedNode = {gameStartedMessage, {nullptr}};
 			std::shared_ptr<ServerMessageQueue> gameStartedNodePtr =
-			    std::make_shared<ServerMessageQueue>(gameStartedNode);
+			    makeNode(gameStartedMessage);
 			currentGameMessagesHead = gameStartedNodePtr;
-			messageQueueTail->next = currentGameMessagesHead;
-			messageQueueTail = messageQueueTail->next;
+			appendNode(currentGameMessagesHead);
+			record(currentGameMessagesHead);
+			// Connections from now on start at the GameStarted message.
+			acceptedPlayerMessagesHead = nullptr;
 
 			// Prepare Turn 0
 			DataServerMessage turn0;
 			turn0.type = ServerMessageEnum::Turn;
 			turn0.turn = {0};
-			for (size_t i = 0; i < joinedPlayers.size(); i++) {
-				joinedPlayers[i].position = {
-				    {uint16_t(random.next() % sizeX)},
-				    {uint16_t(random.next() % sizeY)}};
-				DataEvent event;
-				event.type = EventEnum::PlayerMoved;
-				event.playerID = {uint8_t(i)};
-				event.position = joinedPlayers[i].position;
-				turn0.events.list.push_back(event);
-			}
-			for (uint16_t i = 0; i < initialBlocks; i++) {
-				DataEvent event;
-				event.type = EventEnum::BlockPlaced;
-				event.position = {
-				    {uint16_t(random.next() % sizeX)},
-				    {uint16_t(random.next() % sizeY)}};
-				if (!blocks.contains(event.position)) {
-					blocks.insert(event.position);
-					turn0.events.list.push_back(event);
-				}
-			}
+			game.start(joinedPlayers.size(), turn0);
 
 			// Push the Turn message
-			ServerMessageQueue turnNode = {turn0, {nullptr}};
-			std::shared_ptr<ServerMessageQueue> turnNodePtr =
-			    std::make_shared<ServerMessageQueue>(turnNode);
-			messageQueueTail->next = turnNodePtr;
-			messageQueueTail = messageQueueTail->next;
+			std::shared_ptr<ServerMessageQueue> turnNodePtr = makeNode(turn0);
+			appendNode(turnNodePtr);
+			record(turnNodePtr);
 
-			// Actually notify the clients
+			// Actually notify the clients, then count turns from now.
 			notifyAllConnections();
+			scheduler.stats.clear();
+			scheduler.start();
 		}
 
-		// Processes explosion, returns whether the explosion should continue.
-		bool processExplosion(const DataPosition & position, DataEvent & event) {
-			for (const auto & i : playersByPosition[position]) {
-				event.playersDestroyed.list.push_back(i);
-				playersDestroyed.insert(i);
-			}
-			if (blocks.contains(position)) {
-				event.blocksDestroyed.list.push_back(position);
-				blocksDestroyed.insert(position);
-				return false;
-			}
-			return true;
-		}
-
-		void processExplosions(uint16_t turn, DataServerMessage & turnMessage) {
-			while (!bombs.empty() && bombs.top().first.timer.value == turn) {
-				DataEvent event;
-				event.type = EventEnum::BombExploded;
-				DataBomb bomb = bombs.top().first;
-				DataU32 bombID = bombs.top().second;
-				event.bombID = bombID;
-				bombs.pop();
-
-				uint16_t leftX =
-				    uint16_t(std::max(0, bomb.position.x.value - explosionRadius));
-				uint16_t rightX = uint16_t(
-				    std::min(sizeX - 1, bomb.position.x.value + explosionRadius)
-				);
-				uint16_t lowY =
-				    uint16_t(std::max(0, bomb.position.y.value - explosionRadius));
-				uint16_t highY = uint16_t(
-				    std::min(sizeY - 1, bomb.position.y.value + explosionRadius)
-				);
-				if (processExplosion(bomb.position, event)) {
-					for (int x = bomb.position.x.value - 1; x >= int(leftX); x--) {
-						if (!processExplosion({{uint16_t(x)}, bomb.position.y}, event)) {
-							break;
-						}
-					}
-					for (int x = bomb.position.x.value + 1; x <= int(rightX); x++) {
-						if (!processExplosion({{uint16_t(x)}, bomb.position.y}, event)) {
-							break;
-						}
-					}
-					for (int y = bomb.position.y.value - 1; y >= int(lowY); y--) {
-						if (!processExplosion({bomb.position.x, {uint16_t(y)}}, event)) {
-							break;
-						}
+		/*
+		 * Prepares a queue which brings a new client to the state after `turn`,
+		 * for new connections to start at instead of the messages so far.
+		 * The board is laid out and scores are set in the turn the oldest active
+		 * bomb was placed in, and each active bomb is placed in the turn it was
+		 * really placed in, so that clients count its timer down correctly.
+		 */
+		void takeSnapshot(uint16_t turn) {
+			// The snapshot starts a new arena, so that the old one can be freed.
+			arena = std::make_shared<GameArena>(GAME_ARENA_CHUNK);
+			std::shared_ptr<ServerMessageQueue> head = makeNode(gameStartedMessage);
+			std::shared_ptr<ServerMessageQueue> tail = head;
+			head->sequence = lastSequence;
+			DataServerMessage message;
+			message.type = ServerMessageEnum::Turn;
+			auto appendMessage = [&]() {
+				std::shared_ptr<ServerMessageQueue> node = makeNode(message);
+				tail->link(node);
+				tail = std::move(node);
+				tail->sequence = lastSequence;
+				message.events.list.clear();
+			};
+
+			// Lay out the board, set scores and place active bombs.
+			std::vector<Game::Bomb> activeBombs;
+			uint16_t firstTurn = turn;
+			game.forEachBomb(turn, [&](const Game::Bomb & bomb) {
+				activeBombs.push_back(bomb);
+				uint16_t placedTurn = uint16_t(bomb.first.timer.value - bombTimer);
+				firstTurn = std::min(firstTurn, placedTurn);
+			});
+			for (uint16_t placedTurn = firstTurn; placedTurn <= turn; placedTurn++) {
+				message.turn = {placedTurn};
+				if (placedTurn == firstTurn) {
+					for (size_t i = 0; i < game.playerCount(); i++) {
+						DataEvent event;
+						event.type = EventEnum::PlayerMoved;
+						event.playerID = {uint8_t(i)};
+						event.position = game.positions[i];
+						message.events.list.push_back(event);
 					}
-					for (int y = bomb.position.y.value + 1; y <= int(highY); y++) {
-						if (!processExplosion({bomb.position.x, {uint16_t(y)}}, event)) {
-							break;
+					game.listBlocks(message.events);
+					for (const auto & [playerID, score] : game.playerScores.map) {
+						if (score.value > 0) {
+							DataEvent event;
+							event.type = EventEnum::ScoreChanged;
+							event.playerID = playerID;
+							event.score = score;
+							message.events.list.push_back(event);
 						}
 					}
 				}
-
-				turnMessage.events.list.push_back(event);
-			}
-
-			for (const DataPosition & block : blocksDestroyed) {
-				blocks.erase(block);
-			}
-		}
-
-		void processPlayerMove(uint8_t playerID, DataServerMessage & turnMessage) {
-			DataPosition position = joinedPlayers[playerID].position;
-			size_t connID = joinedPlayers[playerID].connectionID;
-			std::lock_guard<std::mutex> cGuard(clients.at(connID).inMessageMutex);
-
-			DataEvent event;
-			DataPosition newPosition;
-			int newX = position.x.value, newY = position.y.value;
-			if (playersDestroyed.contains({playerID})) {
-				newPosition = {
-				    {uint16_t(random.next() % sizeX)},
-				    {uint16_t(random.next() % sizeY)}};
-				playersByPosition[position].erase({playerID});
-				playersByPosition[newPosition].insert({playerID});
-				joinedPlayers[playerID].position = newPosition;
-				playerScores.map[{playerID}].value++;
-
-				event.type = EventEnum::PlayerMoved;
-				event.playerID = {playerID};
-				event.position = newPosition;
-				turnMessage.events.list.push_back(event);
-			} else if (clients.at(connID).inMessagePending) {
-				DataClientMessage inMessage = clients.at(connID).inMessage;
-				switch (inMessage.type) {
-				case ClientMessageEnum::PlaceBomb:
-					event.type = EventEnum::BombPlaced;
-					event.bombID = {nextBombID++};
-					event.position = position;
-					turnMessage.events.list.push_back(event);
-
-					bombs.push(
-					    {{position, {uint16_t(turnMessage.turn.value + bombTimer)}},
-					     event.bombID}
-					);
-					break;
-				case ClientMessageEnum::PlaceBlock:
-					if (blocks.contains(position)) {
-						break;
+				for (const auto & [bomb, bombID] : activeBombs) {
+					if (uint16_t(bomb.timer.value - bombTimer) == placedTurn) {
+						DataEvent event;
+						event.type = EventEnum::BombPlaced;
+						event.bombID = bombID;
+						event.position = bomb.position;
+						message.events.list.push_back(event);
 					}
-					blocks.insert(position);
-					event.type = EventEnum::BlockPlaced;
-					event.position = position;
-					turnMessage.events.list.push_back(event);
-					break;
-				case ClientMessageEnum::Move:
-					switch (inMessage.direction.direction) {
-					case DirectionEnum::Left:
-						newX = position.x.value - 1;
-						break;
-					case DirectionEnum::Right:
-						newX = position.x.value + 1;
-						break;
-					case DirectionEnum::Down:
-						newY = position.y.value - 1;
-						break;
-					case DirectionEnum::Up:
-						newY = position.y.value + 1;
-						break;
-					default:
-						break;
-					}
-
-					if (newX < 0 || newY < 0 || newX >= sizeX || newY >= sizeY ||
-					    blocks.contains(
-					        newPosition = {{uint16_t(newX)}, {uint16_t(newY)}}
-					    )) {
-						break;
-					}
-					joinedPlayers[playerID].position = newPosition;
-					playersByPosition[position].erase({playerID});
-					playersByPosition[newPosition].insert({playerID});
-					event.type = EventEnum::PlayerMoved;
-					event.playerID = {playerID};
-					event.position = newPosition;
-					turnMessage.events.list.push_back(event);
-					break;
-				default:
-					break;
 				}
+				appendMessage();
 			}
 
-			// Mark message as read.
-			if (clients.at(connID).inMessagePending) {
-				clients.at(connID).inMessagePending = false;
-				std::lock_guard<std::mutex> sGuard(forMessagesMutex);
-				pendingMessages--;
-			}
-
-			// Free some memory
-			if (playersByPosition[position].empty()) {
-				playersByPosition.erase(position);
-			}
+			currentGameMessagesHead = head;
+			snapshotTail = tail;
 		}
 
-		void runGame() {
-			for (uint16_t turn = 1; turn <= gameLength; turn++) {
-				// Sleep for some time.
-				std::chrono::milliseconds timespan(turnDuration);
-				std::this_thread::sleep_for(timespan);
-
-				if (isShutdown) {
-					throw InterruptedException();
+		// Wakes the game up for the next turn, when it is due.
+		void scheduleTurn() {
+			turnTimer.expires_at(scheduler.wakeUpTime());
+			turnTimer.async_wait([this](const boost::system::error_code & error) {
+				if (error) {
+					return; // Cancelled during shutdown.
 				}
+				scheduler.finishWaiting();
+				playTurn();
+			});
+		}
+
+		void playTurn() {
+			if (replay) {
+				replayTurn();
+				return;
+			}
+			uint16_t turn = ++currentTurn;
+			Tracer::clock::time_point turnStart = traceStart();
+			DataServerMessage & turnMessage = currentTurnMessage;
+			game.recycleTurnMessage(turnMessage);
 
-				std::shared_ptr<ServerMessageQueue> turnMessagePtr =
-				    std::make_shared<ServerMessageQueue>();
-				turnMessagePtr->message.type = ServerMessageEnum::Turn;
-				turnMessagePtr->message.turn = {turn};
+			// Take the latest message of each player.
+			{
+				TraceScope scope("inputs", turn);
+				inbox.drain([&](const InboxMessage & inMessage) {
+					receiveInput(inMessage);
+				});
+			}
 
-				blocksDestroyed.clear();
-				playersDestroyed.clear();
+			game.playTurn(turn, turnMessage);
 
-				processExplosions(turn, turnMessagePtr->message);
+			std::shared_ptr<ServerMessageQueue> turnMessagePtr;
+			{
+				TraceScope scope("encode", turn);
+				turnMessagePtr = makeNode(turnMessage);
+			}
 
-				// Process player moves
-				for (size_t i = 0; i < joinedPlayers.size(); i++) {
-					processPlayerMove(uint8_t(i), turnMessagePtr->message);
+			// Only snapshots and the list of clients need to be guarded, the queue
+			// is published to connections without locks.
+			appendNode(turnMessagePtr);
+			{
+				TraceScope scope("record", turn);
+				record(turnMessagePtr);
+			}
+			{
+				Tracer::clock::time_point lockStart = traceStart();
+				std::lock_guard<std::mutex> guard(roomMutex);
+				traceSince("room lock", lockStart, turn);
+				if (snapshotInterval > 0 && turn % snapshotInterval == 0 &&
+				    turn < gameLength) {
+					TraceScope scope("snapshot", turn);
+					takeSnapshot(turn);
 				}
-
-				messageQueueTail->next = turnMessagePtr;
-				messageQueueTail = messageQueueTail->next;
+				TraceScope scope("notify", turn);
 				notifyAllConnections();
 			}
+			traceSince("turn", turnStart, turn);
+			scheduler.endTurn();
+			metrics.recordTurn(
+			    scheduler.stats.lastLateness, scheduler.stats.lastProcessing,
+			    scheduler.stats.lastOverrun, turnMessage.events.list.size(),
+			    turnMessagePtr->bytes.size()
+			);
+
+			if (turn < gameLength) {
+				scheduleTurn();
+			} else {
+				finishGame();
+			}
+		}
+
+		// Ends the game after its last turn, and goes back to the lobby.
+		void finishGame() {
+			endGame();
+			clearGame();
+			// Messages might have come before the lobby took them, see to them.
+			collectPlayers();
+		}
+
+		void endGame() {
+			debug(
+			    "Game ended in room " + std::to_string(index) + ": " +
+			    scheduler.stats.toString()
+			);
 
-			std::lock_guard<std::mutex> guard(serverMutex);
+			std::lock_guard<std::mutex> guard(roomMutex);
 			state = GameState::Lobby;
 
+			DataServerMessage gameEndedMessage;
+			gameEndedMessage.type = ServerMessageEnum::GameEnded;
+			gameEndedMessage.scores = game.playerScores;
 			std::shared_ptr<ServerMessageQueue> gameEndedPtr =
-			    std::make_shared<ServerMessageQueue>();
-			gameEndedPtr->message.type = ServerMessageEnum::GameEnded;
-			gameEndedPtr->message.scores = playerScores;
+			    makeNode(gameEndedMessage);
 
-			messageQueueTail->next = gameEndedPtr;
-			messageQueueTail = messageQueueTail->next;
+			appendNode(gameEndedPtr);
+			record(gameEndedPtr);
+			if (recorder) {
+				recorder->flush();
+			}
 			notifyAllConnections();
 		}
 
 		void clearGame() {
-			std::lock_guard<std::mutex> guard(serverMutex);
+			std::lock_guard<std::mutex> guard(roomMutex);
 			joinedPlayers.clear();
-			blocks.clear();
-			playerScores.map.clear();
-			playersByPosition.clear();
-			while (!bombs.empty()) {
-				bombs.pop();
-			}
 
 			acceptedPlayerMessagesHead = currentGameMessagesHead = messageQueueTail =
-			    nullptr;
+			    snapshotTail = nullptr;
+
+			// Release the game's memory as a whole, once clients are done with it.
+			arena = std::make_shared<GameArena>(GAME_ARENA_CHUNK);
+			game.recycleTurnMessage(currentTurnMessage);
+			game.clear();
 
 			// Clear pending messages, including join messages.
-			for (auto & i : clients) {
-				ClientConnection & client = i.second;
-				std::lock_guard<std::mutex> cGuard(client.inMessageMutex);
-				client.joined = false;
-				if (client.inMessagePending) {
-					client.inMessagePending = false;
-					std::lock_guard<std::mutex> sGuard(forMessagesMutex);
-					pendingMessages--;
+			inbox.drain([](const InboxMessage &) {});
+			for (const auto & connection : clients) {
+				connection->joined = false;
+			}
+		}
+
+		// Drops all messages and starts replaying the next game, if anyone is here.
+		void collectViewers() {
+			inbox.drain([](const InboxMessage &) {});
+			{
+				std::lock_guard<std::mutex> guard(roomMutex);
+				if (clients.empty() || replay->games.empty()) {
+					return;
 				}
 			}
+			startReplay();
+			scheduleTurn();
 		}
 
-		// Shuts down the server, closes all connections.
-		void shutdown() {
-			// First, shut down the acceptor.
-			::shutdown(clientAcceptor.native_handle(), SHUT_RDWR);
-
-			// Next, force failure in all connection threads.
-			for (auto & client : clients) {
-				if (client.second.clientSocket) {
-					try {
-						client.second.clientSocket->shutdown(tcp::socket::shutdown_both);
-					} catch (std::exception & e) {
-						// OK
-					}
-					client.second.clientSocket->close();
+		// Lists the recorded start and turn 0 for the clients, like startGame.
+		// The start is pushed to the connections before turn 0 follows it, as
+		// each connection links it after the end of the previous game.
+		void startReplay() {
+			std::lock_guard<std::mutex> guard(roomMutex);
+			state = GameState::Game;
+			currentTurn = 0;
+			replayMessage = 0;
+			currentGameMessagesHead = makeReplayNode();
+			appendNode(currentGameMessagesHead);
+			acceptedPlayerMessagesHead = nullptr;
+			pushToAllConnections(currentGameMessagesHead);
+			appendNode(makeReplayNode());
+			notifyAllConnections();
+			scheduler.stats.clear();
+			scheduler.start();
+		}
+
+		// Queues the next recorded turn, and after the last one, the game's end,
+		// which is the game's last message.
+		void replayTurn() {
+			size_t messageCount = replay->games[replayGame].size();
+			if (replayMessage + 1 < messageCount) {
+				++currentTurn;
+				std::shared_ptr<ServerMessageQueue> turnNodePtr = makeReplayNode();
+				appendNode(turnNodePtr);
+				{
+					std::lock_guard<std::mutex> guard(roomMutex);
+					notifyAllConnections();
+				}
+				scheduler.endTurn();
+				metrics.recordTurn(
+				    scheduler.stats.lastLateness, scheduler.stats.lastProcessing,
+				    scheduler.stats.lastOverrun, 0, turnNodePtr->bytes.size()
+				);
+			}
+
+			if (replayMessage + 1 < messageCount) {
+				scheduleTurn();
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> guard(roomMutex);
+				state = GameState::Lobby;
+				if (replayMessage < messageCount) {
+					appendNode(makeReplayNode());
 				}
+				notifyAllConnections();
+				acceptedPlayerMessagesHead = currentGameMessagesHead =
+				    messageQueueTail = snapshotTail = nullptr;
+				arena = std::make_shared<GameArena>(GAME_ARENA_CHUNK);
 			}
+			replayGame = (replayGame + 1) % replay->games.size();
+			collectViewers();
+		}
 
-			// Third, set shutdown flag, notify forMessages in case mainLoop is
-			// waiting on it. Otherwise, the server should shut down in the matter of
-			// a single turn.
-			isShutdown = true;
+		/*
+		 * Adds the room's metrics. A client's backlog is the number of messages
+		 * queued after the last one it was given to send.
+		 */
+		void writeMetrics(MetricsWriter & writer) {
+			std::string labels = "room=\"" + std::to_string(index) + "\"";
+			auto seconds = [](const RoomMetrics::Counter & nanos) {
+				return double(RoomMetrics::get(nanos)) / 1e9;
+			};
+
+			size_t clientCount, joinedCount;
+			uint64_t backlogMax = 0, backlogTotal = 0;
 			{
-				std::lock_guard<std::mutex> sGuard(forMessagesMutex);
-				pendingMessages++;
+				std::lock_guard<std::mutex> guard(roomMutex);
+				clientCount = clients.size();
+				joinedCount = joinedPlayers.size();
+				for (const auto & connection : clients) {
+					std::lock_guard<std::mutex> lock(connection->forMessagesMutex);
+					uint64_t backlog =
+					    lastSequence - connection->messageQueueHead->sequence;
+					backlogMax = std::max(backlogMax, backlog);
+					backlogTotal += backlog;
+				}
 			}
-			forMessages.notify_all();
 
-			// Join all connection threads in ClientConnection destructors.
-			clients.clear();
+			writer.describe("robots_clients", "gauge", "Connected clients.");
+			writer.sample("robots_clients", labels, clientCount);
+			writer.describe(
+			    "robots_players", "gauge", "Players in the game or lobby."
+			);
+			writer.sample("robots_players", labels, joinedCount);
+			writer.describe(
+			    "robots_in_game", "gauge", "Whether a game is being played."
+			);
+			writer.sample("robots_in_game", labels, int(state == GameState::Game));
+			writer.describe(
+			    "robots_client_backlog_max", "gauge",
+			    "Messages the furthest behind client has yet to be given."
+			);
+			writer.sample("robots_client_backlog_max", labels, backlogMax);
+			writer.describe(
+			    "robots_client_backlog", "gauge",
+			    "Messages all clients together have yet to be given."
+			);
+			writer.sample("robots_client_backlog", labels, backlogTotal);
+
+			writer.describe("robots_turns_total", "counter", "Turns played.");
+			writer.sample(
+			    "robots_turns_total", labels, RoomMetrics::get(metrics.turns)
+			);
+			writer.describe(
+			    "robots_turn_overruns_total", "counter",
+			    "Turns started more than a turn after their deadline."
+			);
+			writer.sample(
+			    "robots_turn_overruns_total", labels,
+			    RoomMetrics::get(metrics.overruns)
+			);
+			writer.describe(
+			    "robots_turn_processing_seconds_total", "counter",
+			    "Time spent on processing turns."
+			);
+			writer.sample(
+			    "robots_turn_processing_seconds_total", labels,
+			    seconds(metrics.processingNanos)
+			);
+			writer.describe(
+			    "robots_turn_processing_seconds", "gauge",
+			    "Time spent on processing the last turn."
+			);
+			writer.sample(
+			    "robots_turn_processing_seconds", labels,
+			    seconds(metrics.lastProcessingNanos)
+			);
+			writer.describe(
+			    "robots_turn_processing_max_seconds", "gauge",
+			    "The longest time spent on processing a turn."
+			);
+			writer.sample(
+			    "robots_turn_processing_max_seconds", labels,
+			    seconds(metrics.maxProcessingNanos)
+			);
+			writer.describe(
+			    "robots_turn_lateness_seconds_total", "counter",
+			    "Time by which turns started after their deadlines."
+			);
+			writer.sample(
+			    "robots_turn_lateness_seconds_total", labels,
+			    seconds(metrics.latenessNanos)
+			);
+			writer.describe("robots_events_total", "counter", "Events in turns.");
+			writer.sample(
+			    "robots_events_total", labels, RoomMetrics::get(metrics.events)
+			);
+			writer.describe(
+			    "robots_turn_bytes", "gauge", "Encoded size of the last turn."
+			);
+			writer.sample(
+			    "robots_turn_bytes", labels, RoomMetrics::get(metrics.lastTurnBytes)
+			);
+			writer.describe(
+			    "robots_queued_bytes_total", "counter",
+			    "Encoded size of all messages, each is sent to every client."
+			);
+			writer.sample(
+			    "robots_queued_bytes_total", labels,
+			    RoomMetrics::get(metrics.bytesQueued)
+			);
+			writer.describe(
+			    "robots_sent_bytes_total", "counter", "Bytes sent to clients."
+			);
+			writer.sample(
+			    "robots_sent_bytes_total", labels, RoomMetrics::get(metrics.bytesSent)
+			);
+			writer.describe(
+			    "robots_received_bytes_total", "counter",
+			    "Bytes received from clients."
+			);
+			writer.sample(
+			    "robots_received_bytes_total", labels,
+			    RoomMetrics::get(metrics.bytesReceived)
+			);
+			writer.describe(
+			    "robots_received_messages_total", "counter",
+			    "Messages received from clients."
+			);
+			writer.sample(
+			    "robots_received_messages_total", labels,
+			    RoomMetrics::get(metrics.messagesReceived)
+			);
+			writer.describe(
+			    "robots_backlog_disconnects_total", "counter",
+			    "Clients disconnected for falling too far behind."
+			);
+			writer.sample(
+			    "robots_backlog_disconnects_total", labels,
+			    RoomMetrics::get(metrics.backlogDisconnects)
+			);
+		}
+
+		// Stops the game and closes all connections.
+		void close() {
+			turnTimer.cancel();
+			std::lock_guard<std::mutex> guard(roomMutex);
+			for (const auto & connection : clients) {
+				connection->close();
+			}
 		}
 	};
 
-	void listenToClient(Server & server, ClientConnection & connection) {
-		try {
-			// Wait to accept a connection.
-			connection.clientSocket =
-			    std::make_shared<tcp::socket>(server.clientAcceptor.accept());
-			boost::asio::ip::tcp::no_delay option(true);
-			connection.clientSocket->set_option(option);
-			// Once accepted, initialize other connection members, and then create
-			// another clientConnection object which will wait for another connection.
-			connection.inBuffer =
-			    std::make_shared<TCPBuffer>(*connection.clientSocket);
-			connection.outBuffer =
-			    std::make_shared<TCPBuffer>(*connection.clientSocket);
-			connection.clientEmitter =
-			    std::thread(emitToClient, std::ref(connection));
+	// A request for metrics, answered once its headers are read.
+	class MetricsScrape {
+	public:
+		static const size_t REQUEST_SIZE_MAX = 1 << 12;
 
-			{
-				std::lock_guard<std::mutex> guard(server.serverMutex);
-				server.clients.emplace(
-				    std::make_pair(server.nextConnectionID++, std::ref(server))
-				);
+		tcp::socket socket;
+		boost::asio::streambuf request{REQUEST_SIZE_MAX};
+		std::string response;
 
-				/* Send Hello message (prepared in server) and make sure to append turn
-				 * message queue (GameStarted, Turn0, ...) if connected during game. */
-				// Copy helloMessage.
-				ServerMessageQueue first{server.helloMessage, {}};
-				connection.messageQueueHead = connection.messageQueueTail =
-				    std::make_shared<ServerMessageQueue>();
-				connection.pushMessage(std::make_shared<ServerMessageQueue>(first));
-				// If in game, push the current game messages, otherwise, list players.
-				if (server.state == GameState::Game) {
-					connection.pushMessage(server.currentGameMessagesHead);
-				} else {
-					connection.pushMessage(server.acceptedPlayerMessagesHead);
+		explicit MetricsScrape(tcp::socket && newSocket) :
+		    socket(std::move(newSocket)) {
+		}
+	};
+
+	/*
+	 * Accepts connections and hands each of them to one of the rooms. Sockets are
+	 * handled by the I/O threads, games by a separate pool of game threads.
+	 */
+	class Server {
+	public:
+		io_context context;
+		io_context gameContext;
+		executor_work_guard<io_context::executor_type> gameWork;
+
+		variables_map options;
+
+		uint16_t ioThreadCount;
+		uint16_t gameThreadCount;
+		uint16_t simulationThreadCount;
+		// Shared by the rooms, each turn using it only if no other turn is.
+		std::unique_ptr<WorkerPool> simulationWorkers;
+		std::vector<std::unique_ptr<Room>> rooms;
+
+		// Connection-related members
+		tcp::endpoint serverEndpoint;
+		tcp::acceptor clientAcceptor;
+		std::optional<tcp::acceptor> metricsAcceptor;
+		std::vector<std::thread> ioThreads;
+		std::vector<std::thread> gameThreads;
+		// In builds with tracing, SIGUSR1 asks the main thread for the trace. It
+		// is caught here, outside of a signal handler, which could not lock.
+		signal_set traceSignals;
+
+		Server(int argc, char ** argv) :
+		    context(), gameContext(), gameWork(make_work_guard(gameContext)),
+		    options(handleOptions(
+		        argc, argv,
+		        replayRequested(argc, argv) ? getReplayOptionsDescription()
+		                                    : getServerOptionsDescription()
+		    )),
+		    ioThreadCount(options["io-threads"].as<uint16_t>()),
+		    gameThreadCount(optionOr<uint16_t>(options, "game-threads", 1)),
+		    simulationThreadCount(
+		        optionOr<uint16_t>(options, "simulation-threads", 1)
+		    ),
+		    serverEndpoint(tcp::v6(), options["port"].as<port_t>()),
+		    clientAcceptor(context, serverEndpoint), traceSignals(context) {
+			auto checkPositive = [&](const std::string & option, uint16_t value) {
+				if (value == 0) {
+					throw RobotsException(
+					    "Error: the argument ('" + std::to_string(value) +
+					    "') for option '--" + option + "' is invalid.\n" + "Run " +
+					    std::string(argv[0]) + " --help for usage.\n"
+					);
 				}
+			};
+			uint16_t playerCount = optionOr<uint16_t>(options, "players-count", 0);
+			if (playerCount > PLAYER_COUNT_MAX) {
+				throw RobotsException(
+				    "Error: the argument ('" + std::to_string(playerCount) +
+				    "') for option '--players-count' is invalid.\n" + "Run " +
+				    std::string(argv[0]) + " --help for usage.\n"
+				);
+			}
+			checkPositive("io-threads", ioThreadCount);
+			checkPositive("game-threads", gameThreadCount);
+			checkPositive("simulation-threads", simulationThreadCount);
+			uint16_t roomCount = optionOr<uint16_t>(options, "rooms", 1);
+			checkPositive("rooms", roomCount);
+
+			std::shared_ptr<const ReplayFile> replay;
+			if (options.count("replay")) {
+				double speed = options["replay-speed"].as<double>();
+				if (!(speed >= 0)) {
+					throw RobotsException(
+					    "Error: the argument ('" + std::to_string(speed) +
+					    "') for option '--replay-speed' is invalid.\n" + "Run " +
+					    std::string(argv[0]) + " --help for usage.\n"
+					);
+				}
+				replay = std::make_shared<const ReplayFile>(
+				    options["replay"].as<std::string>()
+				);
 			}
 
-			// Now start the listening loop.
-			while (true) {
-				DataClientMessage inMessage;
-				*connection.inBuffer >> inMessage;
-				// Every time a message is received, let the server know.
+			if (simulationThreadCount > 1) {
+				simulationWorkers =
+				    std::make_unique<WorkerPool>(simulationThreadCount - 1);
+			}
+			for (size_t i = 0; i < roomCount; i++) {
+				rooms.push_back(
+				    std::make_unique<Room>(options, gameContext, i, roomCount, replay)
+				);
+				rooms.back()->game.setWorkers(simulationWorkers.get());
+			}
+
+			std::stringstream ss;
+			ss << "Listening for " << serverEndpoint << " with " << roomCount
+			   << " room(s)\n";
+			debug(ss.str());
+
+			if (auto metricsPort = options["metrics-port"].as<port_t>()) {
+				metricsAcceptor.emplace(context, tcp::endpoint(tcp::v6(), metricsPort));
+				acceptScrape();
+			}
+
+			if constexpr (TRACING) {
+				traceSignals.add(SIGUSR1);
+				awaitTraceRequest();
+			}
+
+			// Start accepting connections, handled by the I/O threads.
+			acceptConnection();
+			for (uint16_t i = 0; i < ioThreadCount; i++) {
+				ioThreads.emplace_back([this]() {
+					run(context);
+				});
+			}
+			for (uint16_t i = 0; i < gameThreadCount; i++) {
+				gameThreads.emplace_back([this]() {
+					run(gameContext);
+				});
+			}
+		}
+
+		// Runs the handlers of asynchronous operations until shutdown.
+		static void run(io_context & threadContext) {
+			try {
+				threadContext.run();
+			} catch (std::exception & e) {
 				{
-					std::lock_guard<std::mutex> cGuard(connection.inMessageMutex);
-					connection.inMessage = inMessage;
-					if (!connection.inMessagePending) {
-						connection.inMessagePending = true;
-						{
-							std::lock_guard<std::mutex> sGuard(server.forMessagesMutex);
-							server.pendingMessages++;
-						}
-						server.forMessages.notify_all();
-					}
+					std::lock_guard<std::mutex> guard(exceptionMutex);
+					exceptionPtr = std::current_exception();
 				}
+				exceptionCV.notify_one();
 			}
-		} catch (std::exception & e) {
-			// If something goes wrong, start by closing the socket.
-			connection.disconnected = true;
-			if (connection.clientSocket) {
-				try {
-					connection.clientSocket->shutdown(tcp::socket::shutdown_both);
-				} catch (std::exception & f) {
-					// OK
+		}
+
+		void awaitTraceRequest() {
+			traceSignals.async_wait(
+			    [this](const boost::system::error_code & error, int) {
+				    if (error == boost::asio::error::operation_aborted) {
+					    return; // Cancelled during shutdown.
+				    }
+				    {
+					    std::lock_guard<std::mutex> guard(exceptionMutex);
+					    traceRequested = true;
+				    }
+				    exceptionCV.notify_one();
+				    awaitTraceRequest();
+			    }
+			);
+		}
+
+		void acceptConnection() {
+			clientAcceptor.async_accept(
+			    make_strand(context),
+			    [this](const boost::system::error_code & error, tcp::socket socket) {
+				    if (error == boost::asio::error::operation_aborted) {
+					    return; // Acceptor closed during shutdown.
+				    }
+				    if (!error) {
+					    addConnection(std::move(socket));
+				    }
+				    acceptConnection();
+			    }
+			);
+		}
+
+		void acceptScrape() {
+			metricsAcceptor->async_accept(
+			    make_strand(context),
+			    [this](const boost::system::error_code & error, tcp::socket socket) {
+				    if (error == boost::asio::error::operation_aborted) {
+					    return; // Acceptor closed during shutdown.
+				    }
+				    if (!error) {
+					    serveMetrics(std::make_shared<MetricsScrape>(std::move(socket)));
+				    }
+				    acceptScrape();
+			    }
+			);
+		}
+
+		// Answers any request with the metrics of all rooms, then hangs up.
+		void serveMetrics(const std::shared_ptr<MetricsScrape> & scrape) {
+			async_read_until(
+			    scrape->socket, scrape->request, "\r\n\r\n",
+			    [this, scrape](const boost::system::error_code & error, size_t) {
+				    if (error) {
+					    return;
+				    }
+				    MetricsWriter writer;
+				    for (const std::unique_ptr<Room> & room : rooms) {
+					    room->writeMetrics(writer);
+				    }
+				    std::string body = writer.str();
+				    scrape->response =
+				        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+				        "Content-Length: " +
+				        std::to_string(body.size()) +
+				        "\r\nConnection: close\r\n\r\n" + body;
+				    async_write(
+				        scrape->socket, buffer(scrape->response),
+				        [scrape](const boost::system::error_code &, size_t) {
+					        boost::system::error_code closeError;
+					        scrape->socket.shutdown(
+					            tcp::socket::shutdown_both, closeError
+					        );
+					        scrape->socket.close(closeError);
+				        }
+				    );
+			    }
+			);
+		}
+
+		// New connections go to the room with the fewest of them.
+		Room & chooseRoom() {
+			Room * chosen = rooms.front().get();
+			size_t chosenCount = chosen->connectionCount();
+			for (const std::unique_ptr<Room> & room : rooms) {
+				size_t count = room->connectionCount();
+				if (count < chosenCount) {
+					chosen = room.get(), chosenCount = count;
 				}
-				connection.clientSocket->close();
 			}
+			return *chosen;
+		}
 
-			// Then make sure the emitter thread notices the error by feeding it a
-			// dummy message, which must point tanother dummy message.
-			{
-				std::lock_guard<std::mutex> cGaurd(connection.forMessagesMutex);
-				connection.messageQueueHead = std::make_shared<ServerMessageQueue>();
-				connection.messageQueueHead->next =
-				    std::make_shared<ServerMessageQueue>();
+		void addConnection(tcp::socket && socket) {
+			boost::system::error_code error;
+			socket.set_option(tcp::no_delay(true), error);
+			std::stringstream addressSS;
+			addressSS << socket.remote_endpoint(error);
+			if (error) {
+				return; // Disconnected before it could be registered.
 			}
-			connection.forMessages.notify_all();
 
-			// Lastly, update server's pendingMessages variable.
-			{
-				std::lock_guard<std::mutex> cGuard(connection.inMessageMutex);
-				if (connection.inMessagePending) {
-					connection.inMessagePending = false;
-					std::lock_guard<std::mutex> sGuard(server.forMessagesMutex);
-					server.pendingMessages--;
+			Room & room = chooseRoom();
+			std::shared_ptr<ClientConnection> connection =
+			    std::make_shared<ClientConnection>(room, std::move(socket));
+			connection->address = addressSS.str();
+			// The accept handler does not run on the socket's strand, which the
+			// connection's sends are posted to once it is registered, so register
+			// it and start reading on that strand.
+			dispatch(connection->clientSocket.get_executor(), [&room, connection]() {
+				room.addConnection(connection);
+			});
+		}
+
+		// Writes out the trace, in builds with tracing. Failing to is not fatal.
+		void writeTrace() {
+			if constexpr (TRACING) {
+				const std::string & path = options["trace-file"].as<std::string>();
+				try {
+					Tracer::instance().write(path);
+					debug("Trace written to " + path + "\n");
+				} catch (RobotsException & e) {
+					std::cerr << e.what();
 				}
 			}
 		}
-	}
 
-	void emitToClient(ClientConnection & connection) {
-		try {
-			while (true) {
-				// In a loop, wait for a message ready for sending.
-				std::unique_lock<std::mutex> lock(connection.forMessagesMutex);
-				connection.forMessages.wait(lock, [&]() {
-					return bool(connection.messageQueueHead->next);
-				});
+		// Shuts down the server, closes all connections.
+		void shutdown() {
+			// First, stop the games and the I/O threads, so that nothing else touches
+			// the sockets.
+			gameContext.stop();
+			for (std::thread & gameThread : gameThreads) {
+				gameThread.join();
+			}
+			context.stop();
+			for (std::thread & ioThread : ioThreads) {
+				ioThread.join();
+			}
 
-				// Send the message.
-				connection.messageQueueHead = connection.messageQueueHead->next;
-				*connection.outBuffer << connection.messageQueueHead->message;
+			// Next, close the acceptor and all connections.
+			boost::system::error_code error;
+			clientAcceptor.close(error);
+			if (metricsAcceptor) {
+				metricsAcceptor->close(error);
 			}
-		} catch (std::exception & e) {
-			// If something goes wrong, close the socket.
-			connection.disconnected = true;
-			try {
-				connection.clientSocket->shutdown(tcp::socket::shutdown_both);
-			} catch (std::exception & f) {
-				// OK
+			for (const std::unique_ptr<Room> & room : rooms) {
+				room->close();
 			}
-			connection.clientSocket->close();
 		}
+	};
+
+	void listenToClient(
+	    Room & room, const std::shared_ptr<ClientConnection> & connection
+	) {
+		connection->clientSocket.async_read_some(
+		    buffer(
+		        connection->inBuffer.prepare(ClientConnection::RECEIVE_SIZE),
+		        ClientConnection::RECEIVE_SIZE
+		    ),
+		    [&room,
+		     connection](const boost::system::error_code & error, size_t bytes) {
+			    if (error) {
+				    room.disconnectClient(*connection);
+				    return;
+			    }
+			    connection->inBuffer.commit(bytes);
+			    RoomMetrics::add(room.metrics.bytesReceived, bytes);
+
+			    // Parse all complete messages, leave the incomplete one for later.
+			    try {
+				    while (connection->inBuffer.length() > 0) {
+					    size_t messageStart = connection->inBuffer.position();
+					    DataClientMessage inMessage;
+					    try {
+						    connection->inBuffer >> inMessage;
+					    } catch (BadRead & e) {
+						    connection->inBuffer.rewind(messageStart);
+						    break;
+					    }
+					    RoomMetrics::add(room.metrics.messagesReceived, 1);
+					    if (inMessage.type == ClientMessageEnum::Compress) {
+						    connection->compress = true;
+					    } else {
+						    room.receiveMessage(connection, inMessage);
+					    }
+					    connection->stopAwaitingRequest();
+				    }
+			    } catch (std::exception & e) {
+				    room.disconnectClient(*connection);
+				    return;
+			    }
+
+			    listenToClient(room, connection);
+		    }
+		);
 	}
 
-	void mainLoop(Server & server) {
-		try {
-			while (true) {
-				server.collectPlayers();
-				server.startGame();
-				server.runGame();
-				server.clearGame();
+	void emitToClient(
+	    Room & room, const std::shared_ptr<ClientConnection> & connection
+	) {
+		if (connection->disconnected) {
+			return;
+		}
+		if (connection->sending) {
+			// Still sending, disconnect the client if it fell too far behind.
+			if (room.maxBacklog > 0 &&
+			    room.lastSequence - connection->messageQueueHead->sequence >
+			        room.maxBacklog) {
+				RoomMetrics::add(room.metrics.backlogDisconnects, 1);
+				room.disconnectClient(*connection);
 			}
-		} catch (std::exception & e) {
-			{
-				std::lock_guard<std::mutex> guard(exceptionMutex);
-				exceptionPtr = std::current_exception();
+			return;
+		}
+
+		// Holding the first message keeps all following ones alive.
+		std::shared_ptr<ServerMessageQueue> first;
+		{
+			// Take all messages ready for sending, if there are any.
+			Tracer::clock::time_point lockStart = traceStart();
+			std::lock_guard<std::mutex> lock(connection->forMessagesMutex);
+			traceSince("emit lock", lockStart);
+			// Only the dummy message comes before Hello.
+			bool helloTaken = !connection->messageQueueHead->bytes.empty();
+			first = connection->messageQueueHead->getNext();
+			if (!first || (connection->awaitingRequest && helloTaken)) {
+				return;
+			}
+			connection->outBuffers.clear();
+			while (std::shared_ptr<ServerMessageQueue> next =
+			           connection->messageQueueHead->getNext()) {
+				connection->messageQueueHead = std::move(next);
+				const ServerMessageQueue & node = *connection->messageQueueHead;
+				connection->outBuffers.push_back(buffer(
+				    connection->compress && !node.compressed.empty() ? node.compressed
+				                                                      : node.bytes
+				));
+				if (connection->awaitingRequest) {
+					break;
+				}
 			}
-			exceptionCV.notify_one();
 		}
+
+		// Send the already encoded messages in a single gather write, then look
+		// for the next ones.
+		connection->sending = true;
+		async_write(
+		    connection->clientSocket, connection->outBuffers,
+		    [&room, connection, first, sendStart = traceStart()](
+		        const boost::system::error_code & error, size_t bytes
+		    ) {
+			    traceSince("send", sendStart, bytes);
+			    connection->sending = false;
+			    RoomMetrics::add(room.metrics.bytesSent, bytes);
+			    if (error) {
+				    // If something goes wrong, close the socket.
+				    room.disconnectClient(*connection);
+				    return;
+			    }
+			    emitToClient(room, connection);
+		    }
+		);
 	}
+
 } // namespace
 
 int main(int argc, char ** argv) {
 	installSignalHandler(SIGINT, handleInterrupt, SA_RESTART);
+	if constexpr (TRACING) {
+		Tracer::instance();
+	}
 	std::shared_ptr<Server> server;
 	try {
 		server = std::make_shared<Server>(argc, argv);
 	} catch (NeedHelp & e) {
 		/* Exception reserved for --help option. */
-		std::cout << getServerOptionsDescription();
+		std::cout << getServerOptionsDescription() << "\n"
+		          << getReplayOptionsDescription();
 		return 0;
 	} catch (RobotsException & e) {
 		/* Something went wrong, we know what it is and cannot recover from it, but
@@ -795,19 +1713,25 @@ int main(int argc, char ** argv) {
 		return 1;
 	}
 
-	std::thread mainThread(mainLoop, std::ref(*server));
-
-	/* Listen for exceptions. */
+	/* Listen for exceptions, and for requests to write out the trace. */
 	try {
 		std::unique_lock<std::mutex> guard(exceptionMutex);
-		exceptionCV.wait(guard, [] {
-			return exceptionPtr != nullptr;
-		});
-		std::rethrow_exception(exceptionPtr);
+		while (true) {
+			exceptionCV.wait(guard, [] {
+				return exceptionPtr != nullptr || traceRequested;
+			});
+			if (exceptionPtr) {
+				std::rethrow_exception(exceptionPtr);
+			}
+			traceRequested = false;
+			guard.unlock();
+			server->writeTrace();
+			guard.lock();
+		}
 	} catch (RobotsException & e) {
-		// When the server is interrupted, close the acceptor and all sockets, join
-		// threads, notify mainLoop etc.
+		// When the server is interrupted, stop the games, close the acceptor and
+		// all sockets, join threads etc.
 		server->shutdown();
-		mainThread.join();
+		server->writeTrace();
 	}
 }
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <string>
+
+/*
+ * =============================================================================
+ *                              TurnStats
+ * =============================================================================
+ */
+
+/*
+ * Per-turn timing counters. Processing time is measured from the moment a turn
+ * starts being computed until it is handed to the connections, lateness is how
+ * long after its deadline the turn started.
+ */
+class TurnStats {
+public:
+	using duration = std::chrono::steady_clock::duration;
+
+	uint64_t turns = 0;
+	// Turns which started more than a whole turn after their deadline.
+	uint64_t overruns = 0;
+	duration processingTotal{}, processingMax{};
+	duration latenessTotal{}, latenessMax{};
+	duration lastProcessing{}, lastLateness{};
+	bool lastOverrun = false;
+
+	void record(duration lateness, duration processing) {
+		turns++;
+		lastLateness = lateness, lastProcessing = processing;
+		latenessTotal += lateness, processingTotal += processing;
+		latenessMax = std::max(latenessMax, lateness);
+		processingMax = std::max(processingMax, processing);
+	}
+
+	void clear() {
+		*this = TurnStats();
+	}
+
+	[[nodiscard]] std::string toString() const {
+		using std::chrono::microseconds, std::chrono::duration_cast;
+		auto average = [&](duration total) {
+			return turns ? duration_cast<microseconds>(total).count() / int64_t(turns)
+			             : 0;
+		};
+		std::stringstream ss;
+		ss << turns << " turns, processing avg "
+		   << average(processingTotal) << "us max "
+		   << duration_cast<microseconds>(processingMax).count()
+		   << "us, lateness avg " << average(latenessTotal) << "us max "
+		   << duration_cast<microseconds>(latenessMax).count() << "us, "
+		   << overruns << " overruns\n";
+		return ss.str();
+	}
+};
+
+/*
+ * =============================================================================
+ *                              TurnScheduler
+ * =============================================================================
+ */
+
+/*
+ * Keeps turns on a fixed schedule of deadlines, start + n * period, so that the
+ * time spent on processing a turn and waking up is not added to the period.
+ * The caller sleeps until wakeUpTime(), shortly before the deadline, and, if
+ * `spin` is set, busy-waits for the rest, as sleeping alone may overshoot by a
+ * scheduler tick.
+ * A turn which falls behind by more than a period moves the schedule, so that
+ * the missed turns are not run back to back. With a phase, deadlines fall at
+ * that offset into each period of the clock, so that schedulers given different
+ * phases never tick at the same time.
+ */
+class TurnScheduler {
+public:
+	using clock = std::chrono::steady_clock;
+
+private:
+	clock::duration period;
+	clock::duration spin;
+	std::optional<clock::duration> phase;
+	clock::time_point nextDeadline;
+	clock::time_point turnStart;
+	clock::duration turnLateness{};
+
+public:
+	TurnStats stats;
+
+	TurnScheduler(
+	    clock::duration newPeriod, clock::duration newSpin,
+	    std::optional<clock::duration> newPhase = std::nullopt
+	) :
+	    period(newPeriod), spin(newSpin), phase(newPhase) {
+	}
+
+	/* Schedules the first turn one period from now, or a bit later if phased. */
+	void start() {
+		nextDeadline = clock::now() + period;
+		if (phase && period > clock::duration::zero()) {
+			clock::duration sincePhase =
+			    (nextDeadline.time_since_epoch() - *phase) % period;
+			if (sincePhase < clock::duration::zero()) {
+				sincePhase += period;
+			}
+			if (sincePhase > clock::duration::zero()) {
+				nextDeadline += period - sincePhase;
+			}
+		}
+	}
+
+	[[nodiscard]] clock::time_point deadline() const {
+		return nextDeadline;
+	}
+
+	/* The moment to stop sleeping at, leaving the rest of the wait to spin. */
+	[[nodiscard]] clock::time_point wakeUpTime() const {
+		return nextDeadline - spin;
+	}
+
+	/* Busy-waits from wakeUpTime() until the deadline, then starts the turn. */
+	void finishWaiting() {
+		while (clock::now() < nextDeadline) {
+		}
+		beginTurn();
+	}
+
+	/* Starts the turn, for callers which waited for the deadline themselves. */
+	void beginTurn() {
+		turnStart = clock::now();
+		turnLateness = std::max(turnStart - nextDeadline, clock::duration::zero());
+		nextDeadline += period;
+		// Without a period, turns are meant to run back to back.
+		stats.lastOverrun =
+		    nextDeadline <= turnStart && period > clock::duration::zero();
+		stats.overruns += stats.lastOverrun;
+		if (nextDeadline <= turnStart) {
+			nextDeadline = turnStart + period;
+		}
+	}
+
+	/* Records the time spent on the turn since it started. */
+	void endTurn() {
+		stats.record(turnLateness, clock::now() - turnStart);
+	}
+};
\ No newline at end of file
@@ -0,0 +1,388 @@
+#include <boost/asio.hpp>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer.h"
+#include "exceptions.h"
+#include "grid.h"
+#include "messages.h"
+#include "replay.h"
+#include "utils.h"
+
+using namespace boost::asio;
+using namespace boost::asio::ip;
+
+/*
+ * Regression tests, run with `make test`. Each test throws when something is
+ * not as expected, and the tests which need a server start ./robots-server.
+ */
+
+namespace {
+	using TestClock = std::chrono::steady_clock;
+
+	const std::chrono::seconds SERVER_TIMEOUT{10};
+	// In milliseconds, long enough for both viewers to wait for the next game.
+	const uint64_t REPLAY_TURN_DURATION = 20;
+
+	void check(bool condition, const std::string & what) {
+		if (!condition) {
+			throw RobotsException(what);
+		}
+	}
+
+	// Writes the message to the replay file as the server would have sent it.
+	void writeMessage(ReplayWriter & writer, const DataServerMessage & message) {
+		MemoryBuffer buffer;
+		buffer << message;
+		writer.write(std::span<const char>(buffer.data(), buffer.length()));
+	}
+
+	/* A file written for a test, removed when the test is done. */
+	class TestFile {
+	public:
+		const std::string path;
+
+		explicit TestFile(const std::string & name) :
+		    path("robots-test-" + std::to_string(getpid()) + "-" + name) {
+		}
+
+		TestFile(const TestFile &) = delete;
+		TestFile & operator=(const TestFile &) = delete;
+
+		~TestFile() {
+			std::remove(path.c_str());
+		}
+	};
+
+	/* A server started for a test, stopped when the test is done. */
+	class TestServer {
+	private:
+		pid_t pid;
+
+	public:
+		const port_t port;
+
+		explicit TestServer(std::vector<std::string> arguments) :
+		    port(port_t(20000 + getpid() % 20000)) {
+			arguments.insert(arguments.begin(), "./robots-server");
+			arguments.insert(arguments.end(), {"-p", std::to_string(port)});
+			pid = fork();
+			if (pid == 0) {
+				std::vector<char *> argv;
+				for (std::string & argument : arguments) {
+					argv.push_back(argument.data());
+				}
+				argv.push_back(nullptr);
+				execv(argv[0], argv.data());
+				_exit(127);
+			}
+			check(pid > 0, "could not start ./robots-server");
+		}
+
+		TestServer(const TestServer &) = delete;
+		TestServer & operator=(const TestServer &) = delete;
+
+		~TestServer() {
+			kill(pid, SIGKILL);
+			waitpid(pid, nullptr, 0);
+		}
+
+		// Connects to the server, waiting for it to listen.
+		void connect(tcp::socket & socket) const {
+			tcp::endpoint endpoint(address_v6::loopback(), port);
+			TestClock::time_point deadline = TestClock::now() + SERVER_TIMEOUT;
+			boost::system::error_code error;
+			while (socket.connect(endpoint, error) && TestClock::now() < deadline) {
+				socket.close();
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			check(!error, "could not connect to ./robots-server");
+		}
+	};
+
+	/*
+	 * Fills one row and one column of the board with players, whose cells have
+	 * keys differing only in x or only in y, and checks that they are found
+	 * near their homes, and found at all.
+	 */
+	void testOccupancyLine() {
+		const size_t players = PlayerOccupancy::PLAYERS_MAX;
+		const size_t probesMax = 8;
+		for (bool row : {true, false}) {
+			PlayerOccupancy occupancy;
+			occupancy.reset(players, UINT16_MAX, UINT16_MAX);
+			auto position = [row](size_t i) {
+				uint16_t along = uint16_t(i * 3), across = 7;
+				return row ? DataPosition{{along}, {across}}
+				           : DataPosition{{across}, {along}};
+			};
+			for (size_t i = 0; i < players; i++) {
+				occupancy.insert(position(i), uint8_t(i));
+			}
+			for (size_t i = 0; i < players; i++) {
+				check(
+				    occupancy.probes(position(i)) <= probesMax,
+				    "a player's cell is too far from its home"
+				);
+				std::vector<uint8_t> found;
+				occupancy.forEach(position(i), [&](uint8_t playerID) {
+					found.push_back(playerID);
+				});
+				check(
+				    found == std::vector<uint8_t>{uint8_t(i)},
+				    "a player was not found on its cell"
+				);
+			}
+			for (size_t i = 0; i < players; i += 2) {
+				occupancy.erase(position(i), uint8_t(i));
+			}
+			for (size_t i = 0; i < players; i++) {
+				size_t found = 0;
+				occupancy.forEach(position(i), [&](uint8_t) {
+					found++;
+				});
+				bool kept = i % 2 == 1;
+				check(
+				    found == size_t(kept) &&
+				        occupancy.positions().contains(position(i)) == kept,
+				    "a cell was not emptied by erasing its player"
+				);
+			}
+		}
+	}
+
+	// Encodes a Turn message of the events, then decodes it into `decoded`.
+	void decodeTurn(
+	    DataServerMessage & decoded, const std::vector<DataEvent> & events
+	) {
+		DataServerMessage message;
+		message.type = ServerMessageEnum::Turn;
+		message.events.list = events;
+		MemoryBuffer buffer;
+		buffer << message;
+		buffer >> decoded;
+	}
+
+	/*
+	 * Decodes a turn into the message of a longer one, whose events decoded in
+	 * place must not keep the fields they had in the longer turn.
+	 */
+	void testDecodeShorterTurn() {
+		DataEvent exploded, placed, moved;
+		exploded.type = EventEnum::BombExploded;
+		exploded.bombID = {5};
+		exploded.playersDestroyed.list = {{1}, {2}};
+		exploded.blocksDestroyed.list = {{{1}, {1}}};
+		placed.type = EventEnum::BombPlaced;
+		placed.bombID = {6};
+		placed.position = {{2}, {3}};
+		moved.type = EventEnum::PlayerMoved;
+		moved.playerID = {3};
+		moved.position = {{2}, {2}};
+		DataServerMessage decoded;
+		decodeTurn(decoded, {exploded, placed, moved});
+		check(decoded.events.list.size() == 3, "the longer turn was not decoded");
+
+		DataEvent emptyExploded;
+		emptyExploded.type = EventEnum::BombExploded;
+		emptyExploded.bombID = {7};
+		decodeTurn(decoded, {moved, emptyExploded});
+		const std::vector<DataEvent> & events = decoded.events.list;
+		check(events.size() == 2, "the shorter turn has the wrong length");
+		check(
+		    events[0].type == EventEnum::PlayerMoved &&
+		        events[0].playerID.value == 3 && events[0].bombID.value == 0 &&
+		        events[0].playersDestroyed.list.empty() &&
+		        events[0].blocksDestroyed.list.empty(),
+		    "an event kept the fields of the one decoded before it"
+		);
+		check(
+		    events[1].type == EventEnum::BombExploded &&
+		        events[1].bombID.value == 7 && events[1].position.x.value == 0 &&
+		        events[1].position.y.value == 0 &&
+		        events[1].playersDestroyed.list.empty(),
+		    "an explosion kept the fields of the event decoded before it"
+		);
+	}
+
+	// Starts a replay file as a server hosting games of `gameLength` would.
+	ReplayWriter startRecording(const std::string & path, uint16_t gameLength) {
+		DataServerMessage hello;
+		hello.type = ServerMessageEnum::Hello;
+		hello.serverName = {"test"};
+		hello.playerCount = {1};
+		hello.sizeX = hello.sizeY = {4};
+		hello.gameLength = {gameLength};
+		hello.explosionRadius = {1};
+		hello.bombTimer = {2};
+		MemoryBuffer helloBuffer;
+		helloBuffer << hello;
+		std::span<const char> helloBytes(helloBuffer.data(), helloBuffer.length());
+		return ReplayWriter(path, helloBytes, REPLAY_TURN_DURATION);
+	}
+
+	// Records a game made of the given turns, and its end unless it is cut off.
+	void recordGame(
+	    ReplayWriter & writer, const std::vector<uint16_t> & turns, bool ended
+	) {
+		DataServerMessage message;
+		message.type = ServerMessageEnum::GameStarted;
+		message.players.map[{0}] = {{"player"}, {"[::1]:1"}};
+		writeMessage(writer, message);
+		message.type = ServerMessageEnum::Turn;
+		for (uint16_t turn : turns) {
+			message.turn = {turn};
+			writeMessage(writer, message);
+		}
+		if (ended) {
+			message.type = ServerMessageEnum::GameEnded;
+			message.scores.map[{0}] = {uint32_t(turns.size())};
+			writeMessage(writer, message);
+		}
+	}
+
+	// Records games of turns 0 to `gameLength`.
+	void recordGames(
+	    const std::string & path, size_t games, uint16_t gameLength
+	) {
+		ReplayWriter writer = startRecording(path, gameLength);
+		std::vector<uint16_t> turns;
+		for (uint16_t turn = 0; turn <= gameLength; turn++) {
+			turns.push_back(turn);
+		}
+		for (size_t game = 0; game < games; game++) {
+			recordGame(writer, turns, true);
+		}
+	}
+
+	// Reads Hello, then checks that `games` whole games of `gameLength` follow.
+	void watchGames(tcp::socket & socket, size_t games, uint16_t gameLength) {
+		TCPBuffer buffer(socket);
+		DataServerMessage message;
+		buffer >> message;
+		check(message.type == ServerMessageEnum::Hello, "no Hello");
+		for (size_t game = 0; game < games; game++) {
+			buffer >> message;
+			check(
+			    message.type == ServerMessageEnum::GameStarted,
+			    "a game did not start with GameStarted"
+			);
+			for (uint16_t turn = 0; turn <= gameLength; turn++) {
+				buffer >> message;
+				check(
+				    message.type == ServerMessageEnum::Turn &&
+				        message.turn.value == turn,
+				    "turn " + std::to_string(turn) + " of a game was not next"
+				);
+			}
+			buffer >> message;
+			check(
+			    message.type == ServerMessageEnum::GameEnded,
+			    "a game did not end after its last turn"
+			);
+		}
+	}
+
+	// Serves the replay file to `viewerCount` viewers, who watch `games` games.
+	void watchReplay(
+	    const std::string & path, size_t viewerCount, size_t games,
+	    uint16_t gameLength
+	) {
+		TestServer server({"--replay", path});
+		io_context context;
+		std::vector<std::future<void>> viewers;
+		std::vector<std::unique_ptr<tcp::socket>> sockets;
+		for (size_t i = 0; i < viewerCount; i++) {
+			sockets.push_back(std::make_unique<tcp::socket>(context));
+			server.connect(*sockets.back());
+			viewers.push_back(std::async(
+			    std::launch::async,
+			    [&socket = *sockets.back(), games, gameLength]() {
+				    watchGames(socket, games, gameLength);
+			    }
+			));
+		}
+		// Viewers still reading by the deadline are unblocked, and fail.
+		TestClock::time_point deadline = TestClock::now() + SERVER_TIMEOUT;
+		std::vector<bool> finished;
+		for (std::future<void> & viewer : viewers) {
+			finished.push_back(
+			    viewer.wait_until(deadline) == std::future_status::ready
+			);
+		}
+		for (const std::unique_ptr<tcp::socket> & socket : sockets) {
+			boost::system::error_code error;
+			socket->shutdown(socket_base::shutdown_both, error);
+		}
+		for (size_t i = 0; i < viewers.size(); i++) {
+			if (finished[i]) {
+				viewers[i].get();
+			}
+		}
+		check(
+		    std::find(finished.begin(), finished.end(), false) == finished.end(),
+		    "the viewers did not see all games in time"
+		);
+	}
+
+	/*
+	 * Replays several games to two viewers at once, as each game's start is
+	 * linked after the end of the previous one by both of them.
+	 */
+	void testReplayToTwoViewers() {
+		TestFile file("games.replay");
+		recordGames(file.path, 3, 2);
+		watchReplay(file.path, 2, 3, 2);
+	}
+
+	/*
+	 * Loads a recording of a game of turn 0 alone, between a game missing a
+	 * turn and one cut off, and replays the only whole game, twice.
+	 */
+	void testBrokenReplay() {
+		TestFile file("broken.replay");
+		{
+			ReplayWriter writer = startRecording(file.path, 0);
+			recordGame(writer, {0, 2}, true);
+			recordGame(writer, {0}, true);
+			recordGame(writer, {0}, false);
+		}
+		{
+			ReplayFile replay(file.path);
+			check(replay.games.size() == 1, "broken games were not left out");
+			check(replay.games[0].size() == 3, "the whole game was not kept");
+		}
+		watchReplay(file.path, 1, 2, 0);
+	}
+
+	const std::vector<std::pair<std::string, std::function<void()>>> TESTS = {
+	    {"occupancy of a line", testOccupancyLine},
+	    {"decoding a shorter turn", testDecodeShorterTurn},
+	    {"replay to two viewers", testReplayToTwoViewers},
+	    {"broken replay", testBrokenReplay},
+	};
+} // namespace
+
+int main() {
+	size_t failed = 0;
+	for (const auto & [name, test] : TESTS) {
+		try {
+			test();
+			std::cout << "ok " << name << "\n";
+		} catch (std::exception & e) {
+			failed++;
+			std::cout << "FAILED " << name << ": " << e.what() << "\n";
+		}
+	}
+	return failed > 0 ? 1 : 0;
+}
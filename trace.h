@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "exceptions.h"
+
+/*
+ * Tracing is built in with `make TRACE=1`, like DEBUG only with a flag of its
+ * own. Otherwise, every call below does nothing and is compiled away.
+ */
+#ifdef ROBOTS_TRACE
+const bool TRACING = true;
+#else
+const bool TRACING = false;
+#endif
+
+/*
+ * =============================================================================
+ *                                  Tracer
+ * =============================================================================
+ */
+
+/*
+ * A ring of the latest spans of time, each with a name, the thread it ran on
+ * and a number, such as the turn. Any thread records spans without locks: it
+ * claims the next slot from a shared counter, and publishes it with the slot's
+ * sequence number, which is cleared while the slot is written. A reader copies
+ * a slot and keeps it only if its sequence number was the same before and
+ * after, so that a slot overwritten meanwhile is skipped.
+ */
+class Tracer {
+public:
+	using clock = std::chrono::steady_clock;
+
+	static const size_t CAPACITY = 1 << 16;
+
+private:
+	class Slot {
+	public:
+		std::atomic<uint64_t> sequence = 0;
+		std::atomic<const char *> name = nullptr;
+		std::atomic<uint64_t> startNanos = 0;
+		std::atomic<uint64_t> durationNanos = 0;
+		std::atomic<uint64_t> argument = 0;
+		std::atomic<uint32_t> thread = 0;
+	};
+
+	class Span {
+	public:
+		const char * name;
+		uint64_t startNanos, durationNanos, argument;
+		uint32_t thread;
+	};
+
+	clock::time_point epoch = clock::now();
+	std::unique_ptr<Slot[]> slots = std::make_unique<Slot[]>(CAPACITY);
+	std::atomic<uint64_t> nextSlot = 0;
+	std::atomic<uint32_t> nextThread = 0;
+
+	[[nodiscard]] uint64_t nanos(clock::time_point time) const {
+		return uint64_t(std::max<int64_t>(
+		    0, std::chrono::duration_cast<std::chrono::nanoseconds>(time - epoch)
+		           .count()
+		));
+	}
+
+	// Threads are numbered in the order in which they first record a span.
+	uint32_t threadNumber() {
+		thread_local uint32_t number = nextThread.fetch_add(1) + 1;
+		return number;
+	}
+
+public:
+	/* The tracer of the process, only created once something is traced. */
+	static Tracer & instance() {
+		static Tracer tracer;
+		return tracer;
+	}
+
+	/* Records a span, named by a string which outlives the tracer. */
+	void record(
+	    const char * name, clock::time_point start, clock::time_point end,
+	    uint64_t argument
+	) {
+		uint64_t sequence = nextSlot.fetch_add(1, std::memory_order_relaxed);
+		uint64_t startNanos = nanos(start);
+		uint64_t endNanos = std::max(startNanos, nanos(end));
+		Slot & slot = slots[sequence % CAPACITY];
+		slot.sequence.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.name.store(name, std::memory_order_relaxed);
+		slot.startNanos.store(startNanos, std::memory_order_relaxed);
+		slot.durationNanos.store(endNanos - startNanos, std::memory_order_relaxed);
+		slot.argument.store(argument, std::memory_order_relaxed);
+		slot.thread.store(threadNumber(), std::memory_order_relaxed);
+		slot.sequence.store(sequence + 1, std::memory_order_release);
+	}
+
+	/*
+	 * Writes the spans in the ring to `path` in the Chrome trace event format,
+	 * for chrome://tracing or Perfetto, as complete events in microseconds.
+	 */
+	void write(const std::string & path) const {
+		std::vector<Span> spans;
+		spans.reserve(CAPACITY);
+		for (size_t i = 0; i < CAPACITY; i++) {
+			const Slot & slot = slots[i];
+			uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			Span span{
+			    slot.name.load(std::memory_order_relaxed),
+			    slot.startNanos.load(std::memory_order_relaxed),
+			    slot.durationNanos.load(std::memory_order_relaxed),
+			    slot.argument.load(std::memory_order_relaxed),
+			    slot.thread.load(std::memory_order_relaxed)};
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence != 0 &&
+			    slot.sequence.load(std::memory_order_relaxed) == sequence) {
+				spans.push_back(span);
+			}
+		}
+		std::sort(spans.begin(), spans.end(), [](const Span & a, const Span & b) {
+			return a.startNanos < b.startNanos;
+		});
+
+		std::ofstream file(path, std::ios::trunc);
+		if (!file) {
+			throw RobotsException(
+			    "Error: could not open " + path + " for writing.\n"
+			);
+		}
+		file << std::fixed << std::setprecision(3)
+		     << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		for (size_t i = 0; i < spans.size(); i++) {
+			const Span & span = spans[i];
+			file << (i ? ",\n" : "\n") << "{\"name\":\"" << span.name
+			     << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << span.thread
+			     << ",\"ts\":" << double(span.startNanos) / 1000
+			     << ",\"dur\":" << double(span.durationNanos) / 1000
+			     << ",\"args\":{\"n\":" << span.argument << "}}";
+		}
+		file << "\n]}\n";
+	}
+};
+
+/*
+ * =============================================================================
+ *                                TraceScope
+ * =============================================================================
+ */
+
+/* The time a span starts at, only taken when tracing. */
+[[nodiscard]] Tracer::clock::time_point traceStart() {
+	if constexpr (TRACING) {
+		return Tracer::clock::now();
+	}
+	return {};
+}
+
+/* Records a span from `start`, given by traceStart(), until now. */
+void traceSince(
+    const char * name, Tracer::clock::time_point start, uint64_t argument = 0
+) {
+	if constexpr (TRACING) {
+		Tracer::instance().record(name, start, Tracer::clock::now(), argument);
+	}
+}
+
+/* Records the span of its own lifetime. */
+class TraceScope {
+private:
+	const char * name;
+	uint64_t argument;
+	Tracer::clock::time_point start;
+
+public:
+	explicit TraceScope(const char * newName, uint64_t newArgument = 0) :
+	    name(newName), argument(newArgument), start(traceStart()) {
+	}
+
+	TraceScope(const TraceScope &) = delete;
+	TraceScope & operator=(const TraceScope &) = delete;
+
+	~TraceScope() {
+		traceSince(name, start, argument);
+	}
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * =============================================================================
+ *                               WorkerPool
+ * =============================================================================
+ */
+
+/*
+ * Threads helping whoever calls run() with one batch of independent tasks at a
+ * time. Tasks are claimed one by one from a shared counter, the caller taking
+ * its share too, so that threads which are done early take over what is left.
+ * A batch started while another one runs, as by a second room, is done by its
+ * caller alone, without waiting.
+ */
+class WorkerPool {
+private:
+	std::vector<std::thread> threads;
+
+	// Held by the caller running a batch.
+	std::mutex batchMutex;
+
+	std::mutex mutex;
+	std::condition_variable wakeCV;
+	std::condition_variable doneCV;
+	uint64_t generation = 0;
+	size_t pendingThreads = 0;
+	bool stopping = false;
+
+	// The current batch, set before the threads are woken up.
+	void (*call)(const void *, size_t) = nullptr;
+	const void * context = nullptr;
+	size_t taskCount = 0;
+	std::atomic<size_t> nextTask = 0;
+
+	void work() {
+		for (size_t task; (task = nextTask.fetch_add(1)) < taskCount;) {
+			call(context, task);
+		}
+	}
+
+	void loop() {
+		uint64_t seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeCV.wait(lock, [&]() {
+					return stopping || generation != seen;
+				});
+				if (stopping) {
+					return;
+				}
+				seen = generation;
+			}
+			work();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pendingThreads == 0) {
+				doneCV.notify_one();
+			}
+		}
+	}
+
+public:
+	/* Starts `helpers` threads, in addition to the callers of run(). */
+	explicit WorkerPool(size_t helpers) {
+		for (size_t i = 0; i < helpers; i++) {
+			threads.emplace_back([this]() {
+				loop();
+			});
+		}
+	}
+
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool & operator=(const WorkerPool &) = delete;
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeCV.notify_all();
+		for (std::thread & thread : threads) {
+			thread.join();
+		}
+	}
+
+	/* Calls `f` with every number below `count`, returns once all are done. */
+	template <typename F> void run(size_t count, const F & f) {
+		std::unique_lock<std::mutex> batch(batchMutex, std::try_to_lock);
+		if (!batch || threads.empty() || count < 2) {
+			for (size_t task = 0; task < count; task++) {
+				f(task);
+			}
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			call = [](const void * batchContext, size_t task) {
+				(*static_cast<const F *>(batchContext))(task);
+			};
+			context = &f;
+			taskCount = count;
+			nextTask = 0;
+			pendingThreads = threads.size();
+			generation++;
+		}
+		wakeCV.notify_all();
+		work();
+		std::unique_lock<std::mutex> lock(mutex);
+		doneCV.wait(lock, [&]() {
+			return pendingThreads == 0;
+		});
+	}
+};